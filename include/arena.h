@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "htable.h"
+
+/*
+ * Per-client tracking arena.
+ *
+ * RM handles only live as long as the client (hRoot) that owns them, and
+ * freeing the client implicitly frees every handle below it. Records are
+ * grouped by client so a client teardown detaches the whole group with
+ * one lookup.
+ *
+ * Arenas do no locking, callers serialize access to the index themselves.
+ */
+
+typedef struct {
+  uint32_t root;
+  /* hObject -> record */
+  htable_t objects;
+} client_arena_t;
+
+extern client_arena_t *arena_get(htable_t *arenas, uint32_t root);
+extern client_arena_t *arena_find(const htable_t *arenas, uint32_t root);
+extern void *arena_find_object(const htable_t *arenas, uint32_t root,
+                               uint32_t object);
+extern client_arena_t *arena_detach(htable_t *arenas, uint32_t root);
+extern void arena_free(client_arena_t *arena);
+extern size_t arena_index_usage(const htable_t *arenas);
+
+#endif
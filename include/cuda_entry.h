@@ -17,23 +17,67 @@ typedef int (*cuda_sym_t)();
 
 #define HOOK_NAME(NAME) hook_##NAME
 
-#define HOOK_FUNC(NAME) {.name = #NAME, .hook_pfn = HOOK_NAME(NAME)}
+#define HOOK_FUNC(NAME) {.name = #NAME, .hook_pfn = HOOK_NAME(NAME)},
+
+/* cuGetProcAddress asks for PROC_NAME since CUDA 3.2 */
+#define HOOK_FUNC_V2(NAME, PROC_NAME)                           \
+  {.name = #NAME, .proc_name = #PROC_NAME,                      \
+   .hook_pfn = HOOK_NAME(NAME), .cudaVersion = 3020},
+
+/* resolved for our own use, never replaced */
+#define REAL_FUNC(NAME) {.name = #NAME, .hook_pfn = NULL},
 
 /*
- * enum order should keep consistant with <cuda_hook_funcs_data> in hook.c
+ * every driver symbol we resolve, the single source of entry_enum_t and
+ * cuda_hook_funcs_data in cuda_hook.c
  */
-typedef enum {
-  CUDA_ENTRY_ENUM(cuGetProcAddress),
-  CUDA_ENTRY_ENUM(cuGetProcAddress_v2),
+#define CUDA_ENTRY_SPEC(HOOK, HOOK_V2, REAL)    \
+  HOOK(cuGetProcAddress)                        \
+  HOOK(cuGetProcAddress_v2)                     \
+  HOOK(cuInit)                                  \
+                                                \
+  HOOK(cuLaunchKernel)                          \
+  HOOK(cuLaunchKernelEx)                        \
+  HOOK(cuLaunchKernel_ptsz)                     \
+  HOOK(cuLaunchKernelEx_ptsz)                   \
+                                                \
+  HOOK_V2(cuMemAlloc_v2, cuMemAlloc)            \
+  HOOK_V2(cuMemAllocPitch_v2, cuMemAllocPitch)  \
+  HOOK(cuMemCreate)                             \
+  HOOK_V2(cuMemGetInfo_v2, cuMemGetInfo)        \
+                                                \
+  REAL(cuCtxGetDevice)                          \
+  REAL(cuDeviceGetPCIBusId)
 
-  CUDA_ENTRY_ENUM(cuLaunchKernel),
-  CUDA_ENTRY_ENUM(cuLaunchKernelEx),
-  CUDA_ENTRY_ENUM(cuLaunchKernel_ptsz),
-  CUDA_ENTRY_ENUM(cuLaunchKernelEx_ptsz),
+#define CUDA_ENTRY_ENUM_ITEM(NAME, ...) CUDA_ENTRY_ENUM(NAME),
+
+typedef enum {
+  CUDA_ENTRY_SPEC(CUDA_ENTRY_ENUM_ITEM, CUDA_ENTRY_ENUM_ITEM,
+                  CUDA_ENTRY_ENUM_ITEM)
 
   ENTRY_END,
 } entry_enum_t;
 
+#define CUDA_SUCCESS 0
+#define CUDA_ERROR_OUT_OF_MEMORY 2
+
+typedef unsigned long long CUdeviceptr;
+typedef unsigned long long CUmemGenericAllocationHandle;
+
+#define CU_MEM_LOCATION_TYPE_DEVICE 1
+
+typedef struct CUmemLocation_st {
+  int type;
+  int id;
+} CUmemLocation;
+
+/* leading fields of CUmemAllocationProp, only read up to location */
+typedef struct CUmemAllocationProp_st {
+  int type;
+  int requestedHandleTypes;
+  CUmemLocation location;
+} CUmemAllocationProp;
+
 typedef struct CUlaunchConfig_st {
   unsigned int gridDimX;
   unsigned int gridDimY;
@@ -0,0 +1,98 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <linux/ioctl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook.h"
+
+/*
+ * ioctl dispatch tables.
+ *
+ * RM handlers are indexed by _IOC_NR of the command and carry a mask of
+ * the nvidia fd classes they apply to. UVM commands aren't _IOC encoded,
+ * their handlers live in a table of their own keyed by the full command,
+ * so the two number spaces can't collide. The ioctl hook loads the mask
+ * of a command first, commands nobody handles go straight to the driver
+ * without the fd being classified.
+ *
+ * Handlers are registered at init, before the first ioctl they handle.
+ */
+
+#define IOCTL_NR_COUNT (_IOC_NRMASK + 1)
+#define IOCTL_CLASS(class) (1U << (class))
+/* open addressing by full command, a power of 2 */
+#define UVM_HANDLER_SLOTS 16
+
+/* runs before the driver, setting *success skips the driver call */
+typedef int (*ioctl_pre_t)(ioctl_ctx_t *ctx, void *arg, int *success);
+/* runs after a successful driver call */
+typedef int (*ioctl_post_t)(ioctl_ctx_t *ctx, size_t arg_size, void *arg);
+
+typedef struct {
+  /* IOCTL_CLASS mask of the fds handled, 0 if the command isn't */
+  atomic_uint classes;
+  /* full command, only set in the UVM table */
+  uint64_t cmd;
+  ioctl_pre_t pre;
+  ioctl_post_t post;
+} ioctl_handler_t;
+
+extern ioctl_handler_t ioctl_handlers[IOCTL_NR_COUNT];
+extern ioctl_handler_t uvm_handlers[UVM_HANDLER_SLOTS];
+extern atomic_int uvm_handler_count;
+
+extern int register_ioctl_handler(uint32_t nr, uint32_t classes,
+                                  ioctl_pre_t pre, ioctl_post_t post);
+extern int register_uvm_handler(uint64_t cmd, ioctl_pre_t pre,
+                                ioctl_post_t post);
+
+static inline uint32_t uvm_handler_slot(uint64_t cmd) {
+  return (uint32_t)((cmd * 0x9e3779b97f4a7c15ULL) >> 32) &
+         (UVM_HANDLER_SLOTS - 1);
+}
+
+static inline ioctl_handler_t *uvm_handler_find(uint64_t cmd) {
+  ioctl_handler_t *handler = NULL;
+  uint32_t slot = uvm_handler_slot(cmd);
+  int i = 0;
+
+  for (i = 0; i < UVM_HANDLER_SLOTS; i++) {
+    handler = &uvm_handlers[(slot + i) & (UVM_HANDLER_SLOTS - 1)];
+    if (!atomic_load_explicit(&handler->classes, memory_order_acquire)) {
+      return NULL;
+    }
+    if (handler->cmd == cmd) {
+      return handler;
+    }
+  }
+
+  return NULL;
+}
+
+/* the fd classes handling cmd, 0 for a command nobody handles */
+static inline uint32_t ioctl_handler_classes(uint64_t cmd) {
+  uint32_t classes = atomic_load_explicit(
+      &ioctl_handlers[_IOC_NR(cmd)].classes, memory_order_acquire);
+
+  if (unlikely(atomic_load_explicit(&uvm_handler_count,
+                                    memory_order_relaxed)) &&
+      uvm_handler_find(cmd)) {
+    classes |= IOCTL_CLASS(FD_CLASS_NVIDIA_UVM);
+  }
+
+  return classes;
+}
+
+/* the handler of cmd on an fd of class, which must be in its mask */
+static inline ioctl_handler_t *ioctl_handler(uint64_t cmd, int class) {
+  if (class == FD_CLASS_NVIDIA_UVM) {
+    return uvm_handler_find(cmd);
+  }
+
+  return &ioctl_handlers[_IOC_NR(cmd)];
+}
+
+#endif
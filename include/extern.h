@@ -7,8 +7,55 @@ extern void *create_shm_addr(const char *shm_path_pattern, size_t data_size,
                              share_data_t *share_data);
 extern int wait_duration(struct timespec *interval);
 extern int get_cgroup_id(pid_t pid, char *short_id, size_t id_len);
+extern uint64_t get_proc_start_time(pid_t pid);
+extern int get_device_minor(const char *bus_id, int *minor);
+extern int futex_wait(atomic_uint *addr, uint32_t val,
+                      const struct timespec *timeout);
+extern void futex_wake(atomic_uint *addr, int count);
+extern void fb_info_notify(fb_info_t *fb_info);
+extern size_t fb_info_committed(fb_info_t *fb_info);
+extern void wait_stats_account(fb_wait_stats_t *stats, uint64_t waited,
+                               int timeout);
 
-extern int get_mem_limit(uint32_t *minor, size_t *limit);
-extern int get_core_limit(uint32_t *minor, size_t *limit);
+extern int get_mem_limits(size_t *limits, int count);
+extern int get_core_limits(size_t *limits, int count);
+extern int get_core_provisional(size_t *tokens);
+extern int get_mem_lease(size_t *lease);
+extern int get_mem_wait(size_t *wait_ms);
+extern int get_mem_history(size_t *window_ms);
+extern int get_node_summary(char *path, size_t len);
+extern int get_mem_profile(char *prefix, size_t len, size_t *rate);
+
+extern size_t ledger_free_mem(device_prop_t *dev);
+extern int ledger_reserve(device_prop_t *dev, size_t size);
+extern void ledger_release(device_prop_t *dev, size_t size);
+extern void ledger_lease_init(device_prop_t *dev, size_t chunk);
+extern void ledger_lease_drain(device_prop_t *dev);
+extern void ledger_wait_init(size_t wait_ms);
+extern int ledger_admit(device_prop_t *dev, size_t size);
+
+extern void init_device_prop(void);
+
+extern void watermark_check(device_prop_t *dev);
+
+extern void uvm_register_handlers(void);
+
+extern node_summary_t *node_summary_map(const char *path);
+extern node_ref_t *node_slot_attach(node_summary_t *summary,
+                                    const char *cgroup_id, uint32_t device);
+extern void node_slot_update(node_ref_t *ref, fb_info_t *fb_info);
+
+extern void prof_init(const char *prefix, size_t rate);
+extern prof_site_t *prof_alloc(size_t size);
+extern void prof_free(prof_site_t *site, size_t size);
+extern void prof_adjust(prof_site_t *site, long objs, long bytes);
+
+extern hist_ring_t *hist_map(uint32_t device, size_t window_ms);
+extern void hist_record(hist_ring_t *hist, fb_info_t *fb_info);
+
+extern fb_charge_t *charge_attach(fb_info_t *fb_info);
+extern int charge_pid_alive(pid_t pid, uint64_t start_time);
+extern int charge_live_count(fb_info_t *fb_info);
+extern size_t charge_scavenge(fb_info_t *fb_info, int force);
 
 #endif
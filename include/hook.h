@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "cuda_entry.h"
+#include "htable.h"
 #include "list.h"
 
 #define likely(x) __builtin_expect(!!(x), 1)
@@ -93,10 +94,26 @@ typedef struct {
   cuda_sym_t real_pfn;
   cuda_sym_t hook_pfn;
   char *name;
+  /* name asked for by cuGetProcAddress, if not name */
+  char *proc_name;
   uint64_t flags;
+  /* oldest cudaVersion cuGetProcAddress hands proc_name out for */
   int cudaVersion;
 } entry_t;
 
+/* a slot per 4 entries keeps the seed search short */
+#define ENTRY_INDEX_SIZE 64
+
+/*
+ * perfect hash of entry names, seeded at init so that no two names share
+ * a slot. A lookup costs one hash and one strcmp.
+ */
+typedef struct {
+  uint32_t seed;
+  /* entry number + 1, 0 for an empty slot */
+  uint8_t slots[ENTRY_INDEX_SIZE];
+} entry_index_t;
+
 typedef struct {
   pthread_once_t once;
   void *(*dlopen)(const char *, int);
@@ -104,23 +121,58 @@ typedef struct {
   void *(*dladdr)(const void *, Dl_info *);
   int (*dlclose)(void *);
   int (*ioctl)(int fd, uint64_t cmd, void *args);
+  int (*close)(int fd);
+  int (*close_range)(unsigned int first, unsigned int last, int flags);
+  void (*closefrom)(int lowfd);
+  int (*dup)(int fd);
+  int (*dup2)(int fd, int fd2);
+  int (*dup3)(int fd, int fd2, int flags);
+  int (*fcntl)(int fd, int cmd, ...);
+  void *(*mmap)(void *addr, size_t length, int prot, int flags, int fd,
+                off_t offset);
+  int (*munmap)(void *addr, size_t length);
 } dlfcn_t;
 
+typedef enum {
+  FD_CLASS_UNKNOWN = 0,
+  FD_CLASS_NVIDIA_CTL = 1,
+  FD_CLASS_NVIDIA_DEVICE = 2,
+  FD_CLASS_OTHER = 3,
+  FD_CLASS_NVIDIA_UVM = 4,
+} fd_class_enum_t;
+
 typedef struct {
   int fd;
   void *addr;
 } share_data_t;
 
+/* processes per device that can have their budget reclaimed */
+#define FB_MAX_CHARGES 256
+
+/*
+ * the physical allocation behind one or more heap handles, duplicated
+ * handles share it and its bytes are credited with the last reference
+ */
+typedef struct prof_site prof_site_t;
+
 typedef struct {
+  size_t size;
+  uint32_t refs;
+  /* call site of the allocation when it was profiled, see profile.c */
+  prof_site_t *site;
+} heap_block_t;
+
+typedef struct {
+  uint32_t root;
   uint32_t object;
   size_t size;
-  struct list_head node;
+  heap_block_t *block;
 } device_mem_t;
 
 typedef struct {
+  uint32_t root;
   uint32_t object;
   uint32_t device_id;
-  struct list_head node;
 } rm_mem_t;
 
 typedef struct {
@@ -136,41 +188,180 @@ typedef struct {
 
 typedef struct {
   atomic_int changed;
-  int inited;
+  /* set by server_monitor once params are valid */
+  atomic_int inited;
   struct timespec wait_time;
   token_param_t params;
   sem_t ready;
 } token_attr_t;
 
+/* budget held from the shared ledger by one process, see charge.c */
+typedef struct {
+  /* 0 for a free slot, -1 while it is being reclaimed */
+  atomic_int pid;
+  /* set once start_time is valid */
+  atomic_int ready;
+  /* /proc/<pid>/stat start time, tells a reused pid apart */
+  uint64_t start_time;
+  atomic_size_t charged;
+  /* part of charged sitting unused in the lease of the process */
+  atomic_size_t leased;
+} fb_charge_t;
+
+/* allocations that waited for memory, see ledger.c */
+typedef struct {
+  atomic_uint_fast64_t waits;
+  /* waits that hit the deadline and failed */
+  atomic_uint_fast64_t timeouts;
+  atomic_uint_fast64_t wait_nsec;
+  atomic_uint_fast64_t max_wait_nsec;
+} fb_wait_stats_t;
+
 typedef struct {
   pid_t pid;
   size_t total_mem;
-  size_t free_mem;
+  /* shared ledger, only updated with atomics, see ledger.c */
+  atomic_size_t free_mem;
+  /* taken from free_mem by leases but not handed out, not committed */
+  atomic_size_t leased;
+  /* futex word bumped whenever free_mem grows */
+  atomic_uint free_seq;
+  atomic_int waiters;
+  /* bumped by every failed reservation, leases drain when they see it */
+  atomic_uint drain_seq;
+  fb_wait_stats_t wait_stats;
+  atomic_uint_fast64_t scavenged_at;
+  fb_charge_t charges[FB_MAX_CHARGES];
 } fb_info_t;
 
+#define MAX_CGROUP_ID_LEN 16
+
+/* node summary file, see node.c */
+#define NODE_SUMMARY_MAGIC 0x4e535643U
+#define NODE_SUMMARY_VERSION 1
+#define NODE_MAX_SLOTS 1024
+
+/* usage of one (cgroup, device) pair */
+typedef struct {
+  /* hash of cgroup and device, 0 while the slot is free */
+  atomic_uint_fast64_t key;
+  /* set once device and cgroup are written */
+  atomic_uint ready;
+  uint32_t device;
+  char cgroup[MAX_CGROUP_ID_LEN];
+  atomic_uint_fast64_t limit;
+  atomic_uint_fast64_t committed;
+  atomic_uint_fast64_t peak;
+  /* CLOCK_REALTIME nanoseconds of the last update */
+  atomic_uint_fast64_t updated_at;
+} node_slot_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  node_slot_t slots[NODE_MAX_SLOTS];
+} node_summary_t;
+
+/* what a publisher knows of its slot, to find it again once taken over */
+typedef struct {
+  node_summary_t *summary;
+  _Atomic(node_slot_t *) slot;
+  uint64_t key;
+  uint32_t device;
+  char cgroup[MAX_CGROUP_ID_LEN];
+} node_ref_t;
+
+/* usage history ring, see history.c */
+#define HIST_MAGIC 0x48495354U
+#define HIST_VERSION 1
+#define HIST_SLOTS 4096
+/* entry values carry the low bits of their window above the bytes */
+#define HIST_BYTES_BITS 48
+#define HIST_BYTES_MASK ((1ULL << HIST_BYTES_BITS) - 1)
+
+typedef struct {
+  /* window number, its CLOCK_REALTIME start is window * window_nsec */
+  atomic_uint_fast64_t window;
+  /* bytes committed at the last update in the window */
+  atomic_uint_fast64_t committed;
+  /* most bytes committed at any update in the window */
+  atomic_uint_fast64_t peak;
+} hist_entry_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  atomic_uint_fast64_t window_nsec;
+  hist_entry_t entries[HIST_SLOTS];
+} hist_ring_t;
+
+/* process-local slice of the shared ledger, see ledger.c */
+typedef struct {
+  int enabled;
+  /* leased bytes not handed out yet */
+  atomic_size_t avail;
+  atomic_size_t chunk;
+  size_t min_chunk;
+  size_t max_chunk;
+  /* refill rate window for chunk adaption */
+  atomic_uint_fast64_t window_start;
+  atomic_int refills;
+  /* fb_info->drain_seq when the lease last drained for it */
+  atomic_uint drain_seen;
+} mem_lease_t;
+
 typedef struct {
   pthread_mutex_t mu;
   pthread_t tid;
   uint32_t major;
   uint32_t minor;
   fb_info_t *fb_info;
+  /* our slot in fb_info->charges, NULL if the table was full */
+  fb_charge_t *charge;
+  /* our (cgroup, device) slot of the node summary, NULL if disabled */
+  node_ref_t *node_ref;
+  /* usage history of the device, NULL if disabled */
+  hist_ring_t *hist;
+  mem_lease_t lease;
   size_t alloc_mem;
   sem_t tokens;
   token_attr_t *attr;
+  /* launches of this process that waited for a token */
+  fb_wait_stats_t throttle_stats;
   int mem_limited;
   int core_limited;
-  pthread_once_t once;
-  struct list_head heap_mem_list;
-  struct list_head rm_mem_list;
+  /* hRoot -> client_arena_t of device_mem_t, guarded by mu */
+  htable_t heap_arenas;
 } device_prop_t;
 
+/* per ioctl state handed from the pre to the post handler */
+typedef struct {
+  uint32_t major;
+  uint32_t minor;
+  uint32_t cmd;
+  /* device the reservation was charged to */
+  device_prop_t *dev;
+  /* bytes reserved from the ledger by pre_ioctl, not yet committed */
+  size_t reserved;
+} ioctl_ctx_t;
+
 #define NVIDIA_DEVICE_MAJOR 195
 #define NVIDIA_CTL_MINOR 0xFF
+/* _IOC_TYPE of RM escapes, NV_IOCTL_MAGIC of the driver */
+#define NVIDIA_IOCTL_MAGIC 'F'
+#define MAX_DEVICE_COUNT 32
 /* cuda_hook.<minor>.<cgroup_id> */
 #define HOOK_SHM_PATH_PATTERN "/cuda_hook.%x.%s"
 /* cuda_hook_fb.%x */
 #define HOOK_SHM_FB_MEM_PATH_PATTERN "/cuda_hook_fb.%x"
-#define MAX_CGROUP_ID_LEN 16
+/* cuda_hook_hist.%x */
+#define HOOK_SHM_HIST_PATH_PATTERN "/cuda_hook_hist.%x"
+/* fds above this are classified on every call */
+#define MAX_FD_CLASSES (1 << 16)
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
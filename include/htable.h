@@ -0,0 +1,51 @@
+#ifndef HTABLE_H
+#define HTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Open-addressing hash index with linear probing.
+ *
+ * Keys are 64-bit integers, values are non-NULL pointers. A slot with a NULL
+ * value is empty, deletion uses backward shifting so the table never carries
+ * tombstones and lookups stay short under heavy alloc/free churn.
+ *
+ * The table does no locking, callers serialize access themselves.
+ */
+
+/* RM handles are only unique inside their client, so key by both */
+#define HTABLE_KEY(root, object) \
+  (((uint64_t)(uint32_t)(root) << 32) | (uint64_t)(uint32_t)(object))
+
+#define HTABLE_MIN_CAPACITY 64
+
+typedef struct {
+  uint64_t key;
+  void *value;
+} htable_slot_t;
+
+typedef struct {
+  htable_slot_t *slots;
+  size_t mask;
+  size_t size;
+} htable_t;
+
+extern int htable_init(htable_t *table, size_t capacity);
+extern void htable_destroy(htable_t *table);
+extern void *htable_find(const htable_t *table, uint64_t key);
+extern int htable_insert(htable_t *table, uint64_t key, void *value);
+extern void *htable_remove(htable_t *table, uint64_t key);
+
+static inline size_t htable_size(const htable_t *table) { return table->size; }
+
+/* visits every slot, empty ones have a NULL value */
+#define htable_for_each(slot, table) \
+  for ((slot) = (table)->slots;      \
+       (table)->slots && (slot) <= (table)->slots + (table)->mask; (slot)++)
+
+static inline size_t htable_capacity(const htable_t *table) {
+  return table->slots ? table->mask + 1 : 0;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef NVRC_H
+#define NVRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Public interface of libcuda_hook.so.
+ *
+ * Applications that may run without the hook preloaded should resolve
+ * these symbols with dlsym(RTLD_DEFAULT, ...) and check nvrc_api_version()
+ * before using anything newer than version 1.
+ */
+
+#define NVRC_API_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the API version implemented by the loaded library */
+int nvrc_api_version(void);
+
+/*
+ * Memory watermarks.
+ *
+ * A watermark watches the memory used under the limit of one device by
+ * every process sharing it. It fires NVRC_WATERMARK_HIGH once usage
+ * reaches high, and NVRC_WATERMARK_LOW once usage drops to low again after
+ * that. Usage changed by this process is noticed right away, changes made
+ * by other processes within NVRC_WATERMARK_POLL_MS.
+ */
+
+#define NVRC_WATERMARK_POLL_MS 100
+
+typedef enum {
+  NVRC_WATERMARK_HIGH = 1,
+  NVRC_WATERMARK_LOW = 2,
+} nvrc_watermark_event_t;
+
+/* runs on a helper thread of the library, must not block for long */
+typedef void (*nvrc_watermark_cb_t)(int device, nvrc_watermark_event_t event,
+                                    size_t used, size_t limit, void *arg);
+
+/*
+ * register a callback for device, high and low are bytes in use with
+ * low < high. Returns a watermark id, or -ENODEV if the device isn't
+ * limited, -EINVAL for bad thresholds and -ENOSPC if too many watermarks
+ * are registered.
+ */
+int nvrc_watermark_register(int device, size_t high, size_t low,
+                            nvrc_watermark_cb_t cb, void *arg);
+
+/*
+ * same as nvrc_watermark_register, but crossings are signalled on a
+ * non-blocking eventfd stored in *fd, its counter adds up the crossings
+ * since the last read. Returns the watermark id or a negative errno.
+ */
+int nvrc_watermark_eventfd(int device, size_t high, size_t low, int *fd);
+
+/*
+ * remove a watermark, its eventfd is closed. Once it returns the callback
+ * isn't running and won't be called again, unless it is called from that
+ * callback. Returns 0 or -ENOENT.
+ */
+int nvrc_watermark_unregister(int id);
+
+/*
+ * Budget queries, since version 2.
+ *
+ * Both read the shared ledger and the token state in place, they take no
+ * lock and make no syscall, and are cheap enough to call per allocation or
+ * per batch. The numbers are a snapshot, other processes keep changing
+ * them.
+ */
+
+typedef struct {
+  /* the memory limit of the device */
+  size_t limit;
+  /* used by every process sharing the limit */
+  size_t used;
+  /* left under the limit, including budget leased by this process */
+  size_t remaining;
+  /* charged by this process */
+  size_t charged;
+  /* allocations that waited for memory, of every process sharing it */
+  uint64_t waits;
+  uint64_t wait_timeouts;
+  uint64_t wait_nsec;
+  uint64_t max_wait_nsec;
+} nvrc_mem_info_t;
+
+typedef struct {
+  /* the core limit of the device, in percent */
+  int limit;
+  /* tokens refilled per cycle, tuned by server_monitor */
+  int add_per_cycle;
+  /* tokens available to kernel launches right now */
+  int tokens;
+  /* launches of this process that waited for a token */
+  uint64_t throttled;
+  uint64_t throttle_nsec;
+  uint64_t max_throttle_nsec;
+} nvrc_core_info_t;
+
+/* fill info for device, returns 0 or -ENODEV if memory isn't limited */
+int nvrc_mem_info(int device, nvrc_mem_info_t *info);
+
+/* fill info for device, returns 0 or -ENODEV if cores aren't limited */
+int nvrc_core_info(int device, nvrc_core_info_t *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
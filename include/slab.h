@@ -0,0 +1,56 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Fixed-size object cache for tracking records.
+ *
+ * Objects are carved from mmap'ed chunks, so the allocator never enters
+ * glibc malloc. Every thread keeps a small magazine of free objects per
+ * cache; the shared depot behind the cache lock is only touched when a
+ * magazine runs empty or overflows, and then in batches. Caches beyond
+ * SLAB_MAX_CACHES still work, every call goes to the depot.
+ */
+
+#define SLAB_MAX_CACHES 16
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_CHUNK_SIZE (64UL << 10)
+
+typedef struct {
+  const char *name;
+  size_t obj_size;
+  atomic_int id;
+  pthread_mutex_t mu;
+  /* depot free objects, linked through their first word */
+  void *free_list;
+  size_t free_count;
+  /* chunks, linked through their first word */
+  void *chunks;
+  char *cursor;
+  char *limit;
+  atomic_size_t chunk_bytes;
+  atomic_size_t in_use;
+} slab_cache_t;
+
+typedef struct {
+  size_t obj_size;
+  size_t in_use;
+  size_t reserved_bytes;
+} slab_stats_t;
+
+#define SLAB_CACHE_INIT(NAME, TYPE)                                          \
+  {                                                                          \
+    .name = NAME, .obj_size = sizeof(TYPE), .id = -1,                        \
+    .mu = PTHREAD_MUTEX_INITIALIZER, .free_list = NULL, .free_count = 0,     \
+    .chunks = NULL, .cursor = NULL, .limit = NULL, .chunk_bytes = 0,         \
+    .in_use = 0,                                                             \
+  }
+
+extern void *slab_alloc(slab_cache_t *cache);
+extern void slab_free(slab_cache_t *cache, void *obj);
+extern void slab_stats(slab_cache_t *cache, slab_stats_t *stats);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef UVM_H
+#define UVM_H
+
+#include <stdint.h>
+
+/*
+ * Subset of kernel-open/nvidia-uvm/uvm_ioctl.h. UVM ioctls don't use the
+ * _IOC encoding, the command is the plain number.
+ */
+
+#define UVM_DEVICE_PATH "/dev/nvidia-uvm"
+#define UVM_DEVICE_MINOR 0
+
+#define UVM_INITIALIZE 0x30000001
+#define UVM_DEINITIALIZE 0x30000002
+#define UVM_FREE 34
+
+typedef struct {
+  uint64_t base __attribute__((aligned(8)));
+  uint64_t length __attribute__((aligned(8)));
+  uint32_t rmStatus;
+} UVM_FREE_PARAMS;
+
+#endif
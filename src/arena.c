@@ -0,0 +1,75 @@
+#include "arena.h"
+
+#include "hook.h"
+#include "slab.h"
+
+static slab_cache_t arena_cache =
+    SLAB_CACHE_INIT("client_arena", client_arena_t);
+
+/* find the arena of root, creating it on first use */
+client_arena_t *arena_get(htable_t *arenas, uint32_t root) {
+  client_arena_t *arena = NULL;
+
+  arena = htable_find(arenas, root);
+  if (likely(arena)) {
+    return arena;
+  }
+
+  arena = slab_alloc(&arena_cache);
+  if (unlikely(!arena)) {
+    return NULL;
+  }
+
+  arena->root = root;
+  if (unlikely(htable_insert(arenas, root, arena))) {
+    slab_free(&arena_cache, arena);
+    return NULL;
+  }
+
+  return arena;
+}
+
+client_arena_t *arena_find(const htable_t *arenas, uint32_t root) {
+  return htable_find(arenas, root);
+}
+
+void *arena_find_object(const htable_t *arenas, uint32_t root,
+                        uint32_t object) {
+  client_arena_t *arena = htable_find(arenas, root);
+
+  if (!arena) {
+    return NULL;
+  }
+
+  return htable_find(&arena->objects, object);
+}
+
+/*
+ * unlink the arena of root from the index, the caller releases its records
+ * and then hands it to arena_free
+ */
+client_arena_t *arena_detach(htable_t *arenas, uint32_t root) {
+  return htable_remove(arenas, root);
+}
+
+void arena_free(client_arena_t *arena) {
+  htable_destroy(&arena->objects);
+  slab_free(&arena_cache, arena);
+}
+
+/* bytes used by the index and the per-client tables */
+size_t arena_index_usage(const htable_t *arenas) {
+  htable_slot_t *slot = NULL;
+  client_arena_t *arena = NULL;
+  size_t usage = htable_capacity(arenas) * sizeof(htable_slot_t);
+
+  htable_for_each(slot, arenas) {
+    arena = slot->value;
+    if (arena) {
+      usage += sizeof(client_arena_t) +
+               htable_capacity(&arena->objects) * sizeof(htable_slot_t);
+    }
+  }
+
+  return usage;
+}
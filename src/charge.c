@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "hook.h"
+
+/*
+ * Per-process charges of the shared ledger.
+ *
+ * Every process records the bytes it took from fb_info->free_mem in its own
+ * slot of fb_info->charges. A process killed before it could free its
+ * memory leaves its slot behind, the scavenger finds slots whose pid is
+ * gone (or reused, told apart by the start time) and returns their charge
+ * to the ledger.
+ *
+ * The scavenger runs when a process attaches, when a reservation fails and
+ * periodically from server_monitor.
+ */
+
+/* reservation failures scavenge at most this often */
+#define CHARGE_SCAVENGE_INTERVAL_NSEC (200UL * 1000UL * 1000UL)
+
+static uint64_t charge_clock(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000UL * 1000UL * 1000UL + now.tv_nsec;
+}
+
+int charge_pid_alive(pid_t pid, uint64_t start_time) {
+  uint64_t cur = 0;
+
+  if (kill(pid, 0) < 0 && errno == ESRCH) {
+    return 0;
+  }
+
+  /* the pid was reused by a newer process */
+  cur = get_proc_start_time(pid);
+  if (start_time && cur && cur != start_time) {
+    return 0;
+  }
+
+  return 1;
+}
+
+fb_charge_t *charge_attach(fb_info_t *fb_info) {
+  fb_charge_t *charge = NULL;
+  pid_t pid = getpid();
+  int expected = 0;
+  int i = 0;
+
+  for (i = 0; i < FB_MAX_CHARGES; i++) {
+    charge = &fb_info->charges[i];
+    expected = 0;
+    if (atomic_load_explicit(&charge->pid, memory_order_relaxed) != 0 ||
+        !atomic_compare_exchange_strong(&charge->pid, &expected, pid)) {
+      continue;
+    }
+
+    charge->start_time = get_proc_start_time(pid);
+    atomic_store(&charge->charged, 0);
+    atomic_store(&charge->leased, 0);
+    atomic_store_explicit(&charge->ready, 1, memory_order_release);
+
+    return charge;
+  }
+
+  LOGGER(WARN, "charge table full, budget of %d can't be reclaimed", pid);
+  return NULL;
+}
+
+/* processes holding a slot, including ones not checked for liveness yet */
+int charge_live_count(fb_info_t *fb_info) {
+  int count = 0;
+  int i = 0;
+
+  for (i = 0; i < FB_MAX_CHARGES; i++) {
+    if (atomic_load_explicit(&fb_info->charges[i].pid, memory_order_relaxed)) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+static size_t charge_reclaim(fb_info_t *fb_info, fb_charge_t *charge,
+                             pid_t pid) {
+  size_t charged = 0;
+
+  /* only one scavenger may reclaim a slot */
+  if (!atomic_compare_exchange_strong(&charge->pid, &pid, -1)) {
+    return 0;
+  }
+
+  /* the lease of the dead process goes back with its charge */
+  atomic_fetch_sub_explicit(&fb_info->leased,
+                            atomic_exchange(&charge->leased, 0),
+                            memory_order_relaxed);
+  charged = atomic_exchange(&charge->charged, 0);
+  if (charged) {
+    atomic_fetch_add_explicit(&fb_info->free_mem, charged,
+                              memory_order_release);
+    fb_info_notify(fb_info);
+  }
+
+  atomic_store(&charge->ready, 0);
+  charge->start_time = 0;
+  atomic_store_explicit(&charge->pid, 0, memory_order_release);
+
+  return charged;
+}
+
+/* return the charges of dead processes, the bytes reclaimed */
+size_t charge_scavenge(fb_info_t *fb_info, int force) {
+  fb_charge_t *charge = NULL;
+  uint64_t now = charge_clock();
+  uint64_t last = atomic_load(&fb_info->scavenged_at);
+  size_t reclaimed = 0;
+  pid_t pid = 0;
+  int i = 0;
+
+  if (!force) {
+    if (last && now - last < CHARGE_SCAVENGE_INTERVAL_NSEC) {
+      return 0;
+    }
+    /* somebody else is scavenging right now */
+    if (!atomic_compare_exchange_strong(&fb_info->scavenged_at, &last, now)) {
+      return 0;
+    }
+  } else {
+    atomic_store(&fb_info->scavenged_at, now);
+  }
+
+  for (i = 0; i < FB_MAX_CHARGES; i++) {
+    charge = &fb_info->charges[i];
+    pid = atomic_load_explicit(&charge->pid, memory_order_acquire);
+    if (pid <= 0) {
+      continue;
+    }
+
+    /* a claim that hasn't published its start time yet can't be checked */
+    if (!atomic_load_explicit(&charge->ready, memory_order_acquire)) {
+      if (kill(pid, 0) < 0 && errno == ESRCH) {
+        reclaimed += charge_reclaim(fb_info, charge, pid);
+      }
+      continue;
+    }
+
+    if (!charge_pid_alive(pid, charge->start_time)) {
+      LOGGER(VERBOSE, "reclaim %lu bytes of dead process %d",
+             atomic_load(&charge->charged), pid);
+      reclaimed += charge_reclaim(fb_info, charge, pid);
+    }
+  }
+
+  return reclaimed;
+}
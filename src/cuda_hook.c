@@ -2,11 +2,26 @@
 #include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
+#include "extern.h"
 #include "hook.h"
 
-extern entry_t *find_entry(entry_t *list, int size, const char *symbol);
-extern device_prop_t *get_device_prop(void);
+/*
+ * the driver sub-allocates smaller requests from chunks it already holds,
+ * only allocations of at least this size surely need new memory
+ */
+#define DRIVER_ALLOC_CHUNK (2UL << 20)
+
+extern int entry_index_build(entry_index_t *index, const entry_t *list,
+                             int size, int proc);
+extern entry_t *entry_index_find(const entry_index_t *index, entry_t *list,
+                                 int proc, const char *symbol);
+extern device_prop_t *get_device_prop(int device_id);
+extern device_prop_t *get_core_default_device(void);
+extern device_prop_t *get_mem_default_device(void);
+extern int core_limited(void);
+extern int mem_limited(void);
 
 static int HOOK_NAME(cuGetProcAddress)(const char *symbol, void **pfn,
                                        int cudaVersion, uint64_t flags);
@@ -14,6 +29,8 @@ static int HOOK_NAME(cuGetProcAddress_v2)(const char *symbol, void **pfn,
                                           int cudaVersion, uint64_t flags,
                                           void *symbolStatus);
 
+static int HOOK_NAME(cuInit)(unsigned int flags);
+
 static int HOOK_NAME(cuLaunchKernel)(
     void *f, unsigned int gridDimX, unsigned int gridDimY,
     unsigned int gridDimZ, unsigned int blockDimX, unsigned int blockDimY,
@@ -30,18 +47,146 @@ static int HOOK_NAME(cuLaunchKernelEx_ptsz)(const CUlaunchConfig *config,
                                             void *f, void **kernelParams,
                                             void **extra);
 
+static int HOOK_NAME(cuMemAlloc_v2)(CUdeviceptr *dptr, size_t bytesize);
+static int HOOK_NAME(cuMemAllocPitch_v2)(CUdeviceptr *dptr, size_t *pPitch,
+                                         size_t WidthInBytes, size_t Height,
+                                         unsigned int ElementSizeBytes);
+static int HOOK_NAME(cuMemCreate)(CUmemGenericAllocationHandle *handle,
+                                  size_t size, const CUmemAllocationProp *prop,
+                                  unsigned long long flags);
+static int HOOK_NAME(cuMemGetInfo_v2)(size_t *free, size_t *total);
+
 static entry_t cuda_hook_funcs_data[] = {
-    HOOK_FUNC(cuGetProcAddress),    HOOK_FUNC(cuGetProcAddress_v2),
+    CUDA_ENTRY_SPEC(HOOK_FUNC, HOOK_FUNC_V2, REAL_FUNC)};
 
-    HOOK_FUNC(cuLaunchKernel),      HOOK_FUNC(cuLaunchKernelEx),
-    HOOK_FUNC(cuLaunchKernel_ptsz), HOOK_FUNC(cuLaunchKernelEx_ptsz),
-};
+static atomic_int ordinal_minors[MAX_DEVICE_COUNT];
 
 const static int hook_size = sizeof(cuda_hook_funcs_data) / sizeof(entry_t);
 
+/* by name for dlsym, by proc_name for cuGetProcAddress */
+static pthread_once_t entry_index_once = PTHREAD_ONCE_INIT;
+static entry_index_t name_index;
+static entry_index_t proc_index;
+
 int get_hook_size() { return hook_size; }
 entry_t *get_hook_funcs_data() { return cuda_hook_funcs_data; }
 
+#ifndef NDEBUG
+#define ENTRY_BENCH_ROUNDS 1000
+
+static uint64_t elapsed_nsec(const struct timespec *start) {
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1000000000UL + end.tv_nsec -
+         start->tv_nsec;
+}
+
+/* the linear scan the index replaced, kept to compare against */
+static entry_t *scan_entry(const char *symbol) {
+  int i = 0;
+
+  for (i = 0; i < hook_size; i++) {
+    if (!strcmp(cuda_hook_funcs_data[i].name, symbol)) {
+      return &cuda_hook_funcs_data[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* most dlsym calls ask for symbols we don't hook */
+static const char *bench_misses[] = {
+    "cuInit_v2",     "cuCtxCreate_v2", "cuMemFree_v2",    "cuModuleLoad",
+    "cuStreamCreate", "cuEventRecord", "cuMemcpyHtoD_v2", "cuDeviceGet",
+};
+
+static void bench_entry_index(uint64_t build_nsec) {
+  char *level = getenv("LOGGER_LEVEL");
+  struct timespec start;
+  uint64_t index_nsec = 0, scan_nsec = 0;
+  int lookups = 0, found = 0;
+  int i = 0, j = 0, n = 0;
+
+  /* only worth the time when the result is printed */
+  if (!level || strtoul(level, NULL, 10) < VERBOSE) {
+    return;
+  }
+
+  n = sizeof(bench_misses) / sizeof(bench_misses[0]);
+  lookups = ENTRY_BENCH_ROUNDS * (hook_size + n);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < ENTRY_BENCH_ROUNDS; i++) {
+    for (j = 0; j < hook_size; j++) {
+      found += !!entry_index_find(&name_index, cuda_hook_funcs_data, 0,
+                                  cuda_hook_funcs_data[j].name);
+    }
+    for (j = 0; j < n; j++) {
+      found += !!entry_index_find(&name_index, cuda_hook_funcs_data, 0,
+                                  bench_misses[j]);
+    }
+  }
+  index_nsec = elapsed_nsec(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < ENTRY_BENCH_ROUNDS; i++) {
+    for (j = 0; j < hook_size; j++) {
+      found -= !!scan_entry(cuda_hook_funcs_data[j].name);
+    }
+    for (j = 0; j < n; j++) {
+      found -= !!scan_entry(bench_misses[j]);
+    }
+  }
+  scan_nsec = elapsed_nsec(&start);
+
+  BUG_ON(found);
+  LOGGER(VERBOSE,
+         "hook index built in %lu ns, lookup %.1f ns, linear scan %.1f ns",
+         build_nsec, (double)index_nsec / lookups,
+         (double)scan_nsec / lookups);
+}
+#endif
+
+static void build_entry_index(void) {
+#ifndef NDEBUG
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+  BUILD_BUG_ON(sizeof(cuda_hook_funcs_data) / sizeof(entry_t) != ENTRY_END);
+
+  if (unlikely(
+          entry_index_build(&name_index, cuda_hook_funcs_data, hook_size, 0) ||
+          entry_index_build(&proc_index, cuda_hook_funcs_data, hook_size, 1))) {
+    LOGGER(ERROR, "build hook entry index failed");
+    exit(-1);
+  }
+
+#ifndef NDEBUG
+  bench_entry_index(elapsed_nsec(&start));
+#endif
+}
+
+/* the entry of a symbol resolved through dlsym */
+entry_t *find_hook_entry(const char *symbol) {
+  pthread_once(&entry_index_once, build_entry_index);
+  return entry_index_find(&name_index, cuda_hook_funcs_data, 0, symbol);
+}
+
+static entry_t *find_proc_entry(const char *symbol, int cudaVersion) {
+  entry_t *e = NULL;
+
+  pthread_once(&entry_index_once, build_entry_index);
+  e = entry_index_find(&proc_index, cuda_hook_funcs_data, 1, symbol);
+  if (e) {
+    /* older callers get the original ABI under the base name */
+    return cudaVersion >= e->cudaVersion ? e : NULL;
+  }
+
+  return entry_index_find(&name_index, cuda_hook_funcs_data, 0, symbol);
+}
+
 static int HOOK_NAME(cuGetProcAddress)(const char *symbol, void **pfn,
                                        int cudaVersion, uint64_t flags) {
   entry_t *e = NULL;
@@ -56,7 +201,7 @@ static int HOOK_NAME(cuGetProcAddress)(const char *symbol, void **pfn,
     return ret;
   }
 
-  e = find_entry(cuda_hook_funcs_data, hook_size, symbol);
+  e = find_proc_entry(symbol, cudaVersion);
   if (e) {
     if (likely(!e->real_pfn)) {
       e->real_pfn = *pfn;
@@ -86,7 +231,7 @@ static int HOOK_NAME(cuGetProcAddress_v2)(const char *symbol, void **pfn,
     return ret;
   }
 
-  e = find_entry(cuda_hook_funcs_data, hook_size, symbol);
+  e = find_proc_entry(symbol, cudaVersion);
   if (e) {
     if (likely(!e->real_pfn)) {
       e->real_pfn = *pfn;
@@ -101,17 +246,137 @@ static int HOOK_NAME(cuGetProcAddress_v2)(const char *symbol, void **pfn,
   return ret;
 }
 
+/* device ordinal of the current context, -1 if unknown */
+static int get_ctx_device_id() {
+  int device = -1;
+
+  if (unlikely(!CUDA_FIND_ENTRY(cuda_hook_funcs_data, cuCtxGetDevice))) {
+    return -1;
+  }
+
+  if (CUDA_ENTRY_CALL(cuda_hook_funcs_data, cuCtxGetDevice, &device)) {
+    return -1;
+  }
+
+  return device;
+}
+
+/*
+ * device minor of a CUdevice ordinal, -1 if it can't be told. Ordinals
+ * follow CUDA_VISIBLE_DEVICES and CUDA_DEVICE_ORDER, devices are indexed
+ * by minor, the PCI bus id links the two.
+ */
+static int get_ordinal_minor(int device) {
+  char bus_id[32] = {0};
+  int minor = -1, cached = 0;
+
+  if (unlikely(device < 0 || device >= MAX_DEVICE_COUNT)) {
+    return -1;
+  }
+
+  /* minor + 1, or -1 once the lookup failed */
+  cached = atomic_load_explicit(&ordinal_minors[device], memory_order_relaxed);
+  if (likely(cached)) {
+    return cached > 0 ? cached - 1 : -1;
+  }
+
+  if (unlikely(!CUDA_FIND_ENTRY(cuda_hook_funcs_data, cuDeviceGetPCIBusId))) {
+    return -1;
+  }
+
+  /* the driver may not be initialized yet, ask again next time */
+  if (CUDA_ENTRY_CALL(cuda_hook_funcs_data, cuDeviceGetPCIBusId, bus_id,
+                      (int)sizeof(bus_id), device)) {
+    return -1;
+  }
+
+  if (unlikely(get_device_minor(bus_id, &minor))) {
+    LOGGER(WARN, "can't tell the minor of device %d at %s", device, bus_id);
+    minor = -1;
+  }
+
+  atomic_store_explicit(&ordinal_minors[device], minor < 0 ? -1 : minor + 1,
+                        memory_order_relaxed);
+  return minor;
+}
+
+/* kernels are throttled by the device of the current context */
+static device_prop_t *get_launch_device() {
+  device_prop_t *dev = get_core_default_device();
+
+  if (likely(dev)) {
+    return dev;
+  }
+
+  return get_device_prop(get_ordinal_minor(get_ctx_device_id()));
+}
+
+/* memory limited device of ordinal, or of the current context for -1 */
+static device_prop_t *get_mem_device(int device) {
+  device_prop_t *dev = NULL;
+  int minor = -1;
+
+  if (device < 0) {
+    device = get_ctx_device_id();
+  }
+
+  minor = get_ordinal_minor(device);
+  if (minor < 0) {
+    /* set only while a single device is limited */
+    return get_mem_default_device();
+  }
+
+  dev = get_device_prop(minor);
+  return dev && dev->mem_limited ? dev : NULL;
+}
+
+/* reject allocations that can't fit before the driver starts on them */
+static int mem_admit(int device, size_t size) {
+  device_prop_t *dev = NULL;
+
+  if (likely(!mem_limited())) {
+    return CUDA_SUCCESS;
+  }
+
+  dev = get_mem_device(device);
+  if (!dev || ledger_admit(dev, size)) {
+    return CUDA_SUCCESS;
+  }
+
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "reject %lu bytes on device %u, free: %lu", size,
+         dev->minor, ledger_free_mem(dev));
+#endif
+
+  return CUDA_ERROR_OUT_OF_MEMORY;
+}
+
 static int rate_limit() {
   int ret = 0;
-  device_prop_t *dev = get_device_prop();
-  token_param_t *param = &dev->attr->params;
+  device_prop_t *dev = NULL;
+  struct timespec start, end;
+  uint64_t waited = 0;
+
+  if (likely(!core_limited())) {
+    return 0;
+  }
 
-  if (likely(dev->core_limited)) {
-    while ((ret = sem_wait(&dev->tokens)) == -1 && errno == EINTR) {
-      continue;
+  dev = get_launch_device();
+  if (likely(dev && dev->core_limited)) {
+    /* only throttled launches pay for the clock */
+    ret = sem_trywait(&dev->tokens);
+    if (unlikely(ret == -1 && errno == EAGAIN)) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while ((ret = sem_wait(&dev->tokens)) == -1 && errno == EINTR) {
+        continue;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      waited = (end.tv_sec - start.tv_sec) * 1000UL * 1000UL * 1000UL +
+               end.tv_nsec - start.tv_nsec;
+      wait_stats_account(&dev->throttle_stats, waited, 0);
     }
 
-    atomic_fetch_add(&param->launch_times, 1);
+    atomic_fetch_add(&dev->attr->params.launch_times, 1);
     if (ret == -1) {
       LOGGER(ERROR, "sem_wait errno:%d, %s", errno, strerror(errno));
       ret = 999;
@@ -188,3 +453,78 @@ static int HOOK_NAME(cuLaunchKernelEx_ptsz)(const CUlaunchConfig *config,
 done:
   return ret;
 }
+
+static int HOOK_NAME(cuMemAlloc_v2)(CUdeviceptr *dptr, size_t bytesize) {
+  int ret = 0;
+
+  if (bytesize >= DRIVER_ALLOC_CHUNK) {
+    ret = mem_admit(-1, bytesize);
+    if (unlikely(ret)) {
+      goto done;
+    }
+  }
+
+  ret = CUDA_ENTRY_CALL(cuda_hook_funcs_data, cuMemAlloc_v2, dptr, bytesize);
+done:
+  return ret;
+}
+
+static int HOOK_NAME(cuMemAllocPitch_v2)(CUdeviceptr *dptr, size_t *pPitch,
+                                         size_t WidthInBytes, size_t Height,
+                                         unsigned int ElementSizeBytes) {
+  size_t size = WidthInBytes * Height;
+  int ret = 0;
+
+  if (size >= DRIVER_ALLOC_CHUNK) {
+    ret = mem_admit(-1, size);
+    if (unlikely(ret)) {
+      goto done;
+    }
+  }
+
+  ret = CUDA_ENTRY_CALL(cuda_hook_funcs_data, cuMemAllocPitch_v2, dptr, pPitch,
+                        WidthInBytes, Height, ElementSizeBytes);
+done:
+  return ret;
+}
+
+/* physical allocations always get new backing memory of their own */
+static int HOOK_NAME(cuMemCreate)(CUmemGenericAllocationHandle *handle,
+                                  size_t size, const CUmemAllocationProp *prop,
+                                  unsigned long long flags) {
+  int ret = 0;
+
+  if (likely(prop && prop->location.type == CU_MEM_LOCATION_TYPE_DEVICE)) {
+    ret = mem_admit(prop->location.id, size);
+    if (unlikely(ret)) {
+      goto done;
+    }
+  }
+
+  ret = CUDA_ENTRY_CALL(cuda_hook_funcs_data, cuMemCreate, handle, size, prop,
+                        flags);
+done:
+  return ret;
+}
+
+/* set up the limits before the driver opens its first client */
+static int HOOK_NAME(cuInit)(unsigned int flags) {
+  init_device_prop();
+  return CUDA_ENTRY_CALL(cuda_hook_funcs_data, cuInit, flags);
+}
+
+/* answered from the ledger for limited devices, no driver call needed */
+static int HOOK_NAME(cuMemGetInfo_v2)(size_t *free, size_t *total) {
+  device_prop_t *dev = NULL;
+
+  if (likely(mem_limited() && free && total)) {
+    dev = get_mem_device(-1);
+    if (likely(dev)) {
+      *free = ledger_free_mem(dev);
+      *total = dev->fb_info->total_mem;
+      return CUDA_SUCCESS;
+    }
+  }
+
+  return CUDA_ENTRY_CALL(cuda_hook_funcs_data, cuMemGetInfo_v2, free, total);
+}
@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include "dispatch.h"
+
+ioctl_handler_t ioctl_handlers[IOCTL_NR_COUNT];
+ioctl_handler_t uvm_handlers[UVM_HANDLER_SLOTS];
+atomic_int uvm_handler_count;
+
+static pthread_mutex_t dispatch_mu = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * install the handlers of RM ioctl nr for the nvidia fd classes in the
+ * mask, either handler may be NULL. A command has a single owner, a second
+ * registration fails with -EEXIST.
+ */
+int register_ioctl_handler(uint32_t nr, uint32_t classes, ioctl_pre_t pre,
+                           ioctl_post_t post) {
+  ioctl_handler_t *handler = NULL;
+  int ret = 0;
+
+  /* UVM commands go through register_uvm_handler */
+  if (unlikely(nr >= IOCTL_NR_COUNT || !classes || (!pre && !post) ||
+               (classes & IOCTL_CLASS(FD_CLASS_NVIDIA_UVM)))) {
+    return -EINVAL;
+  }
+
+  handler = &ioctl_handlers[nr];
+
+  pthread_mutex_lock(&dispatch_mu);
+  if (unlikely(atomic_load_explicit(&handler->classes,
+                                    memory_order_relaxed))) {
+    LOGGER(WARN, "ioctl 0x%x already has a handler", nr);
+    ret = -EEXIST;
+    goto finish;
+  }
+
+  handler->pre = pre;
+  handler->post = post;
+  /* publish the handlers before the mask that enables them */
+  atomic_store_explicit(&handler->classes, classes, memory_order_release);
+
+finish:
+  pthread_mutex_unlock(&dispatch_mu);
+  return ret;
+}
+
+/* same for a UVM command, keyed by the full command */
+int register_uvm_handler(uint64_t cmd, ioctl_pre_t pre, ioctl_post_t post) {
+  ioctl_handler_t *handler = NULL;
+  uint32_t slot = uvm_handler_slot(cmd);
+  int ret = -ENOSPC;
+  int i = 0;
+
+  if (unlikely(!pre && !post)) {
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&dispatch_mu);
+  for (i = 0; i < UVM_HANDLER_SLOTS; i++) {
+    handler = &uvm_handlers[(slot + i) & (UVM_HANDLER_SLOTS - 1)];
+    if (atomic_load_explicit(&handler->classes, memory_order_relaxed)) {
+      if (unlikely(handler->cmd == cmd)) {
+        LOGGER(WARN, "uvm ioctl 0x%lx already has a handler", cmd);
+        ret = -EEXIST;
+        break;
+      }
+      continue;
+    }
+
+    handler->cmd = cmd;
+    handler->pre = pre;
+    handler->post = post;
+    atomic_store_explicit(&handler->classes,
+                          IOCTL_CLASS(FD_CLASS_NVIDIA_UVM),
+                          memory_order_release);
+    atomic_fetch_add_explicit(&uvm_handler_count, 1, memory_order_release);
+    ret = 0;
+    break;
+  }
+  pthread_mutex_unlock(&dispatch_mu);
+
+  return ret;
+}
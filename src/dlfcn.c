@@ -1,7 +1,18 @@
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <link.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 
+#include "dispatch.h"
 #include "hook.h"
+#include "uvm.h"
 
 static dlfcn_t __dlfcn_data = {
     .once = PTHREAD_ONCE_INIT,
@@ -10,17 +21,68 @@ static dlfcn_t __dlfcn_data = {
     .dlclose = NULL,
     .dladdr = NULL,
     .ioctl = NULL,
+    .close = NULL,
+    .close_range = NULL,
+    .closefrom = NULL,
+    .dup = NULL,
+    .dup2 = NULL,
+    .dup3 = NULL,
+    .fcntl = NULL,
+    .mmap = NULL,
+    .munmap = NULL,
 };
 
+/*
+ * fd classification cache, one word per fd:
+ * | generation:16 | class:8 | minor:8 |
+ *
+ * close/dup2/dup3 bump the generation, so a classification that raced with
+ * a close can't be published for the reused fd.
+ */
+#define FD_SLOT(gen, class, minor) \
+  ((((gen) & 0xffffU) << 16) | (((class) & 0xffU) << 8) | ((minor) & 0xffU))
+#define FD_SLOT_GEN(slot) ((slot) >> 16)
+#define FD_SLOT_CLASS(slot) (((slot) >> 8) & 0xffU)
+#define FD_SLOT_MINOR(slot) ((slot) & 0xffU)
+
+static atomic_uint fd_classes[MAX_FD_CLASSES];
+
+/* nvidia-uvm gets a dynamic major, learnt from the first uvm fd seen */
+static atomic_int uvm_major = -1;
+
+/*
+ * RTLD_NEXT resolutions, keyed by call site and symbol, in a direct mapped
+ * table of seqlocked slots. Readers never block; a writer that finds its
+ * slot busy just doesn't cache. Each slot is tagged with the link map
+ * generation it was resolved in, so any dlopen or dlclose turns it into a
+ * miss.
+ */
+#define NEXT_SYMBOL_LEN 64
+#define NEXT_SYMBOL_SLOTS 256
+
+typedef struct {
+  /* odd while a writer owns the slot */
+  atomic_uint seq;
+  uint64_t gen;
+  void *caller;
+  void *addr;
+  char symbol[NEXT_SYMBOL_LEN];
+} next_symbol_t;
+
+static next_symbol_t next_symbols[NEXT_SYMBOL_SLOTS];
+
 extern void init(void);
 extern entry_t *get_hook_funcs_data();
 extern int get_hook_size();
-extern entry_t *find_entry(entry_t *list, int size, const char *symbol);
-extern int pre_ioctl(uint32_t major, uint32_t minor, uint32_t cmd, void *args,
-                     int *success);
-extern int post_ioctl(uint32_t major, uint32_t minor, uint32_t cmd, void *args);
-extern int get_device_number(int fd, uint32_t *major, uint32_t *minor);
-extern device_prop_t *get_device_prop(void);
+extern entry_t *find_hook_entry(const char *symbol);
+extern void ioctl_rollback(ioctl_ctx_t *ctx);
+extern int mem_limited(void);
+extern void init_device_prop(void);
+extern int device_prop_ready(void);
+extern int uvm_pre_mmap(size_t length, device_prop_t **dev);
+extern void uvm_post_mmap(device_prop_t *dev, void *addr, size_t length);
+extern void uvm_unmap(uint64_t addr, size_t length);
+extern void uvm_untrack_all(void);
 
 dlfcn_t *get_dlfcn() { return &__dlfcn_data; }
 
@@ -97,6 +159,96 @@ done:
   return handle;
 }
 
+static uint64_t next_symbol_key(void *caller, const char *symbol) {
+  /* FNV-1a seeded with the call site */
+  uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t)caller;
+
+  while (*symbol) {
+    hash = (hash ^ (uint8_t)*symbol++) * 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static int read_link_gen(struct dl_phdr_info *info, size_t size, void *data) {
+  /* the counters are process wide, the first object carries them */
+  if (likely(size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+                         sizeof(info->dlpi_subs))) {
+    *(uint64_t *)data = info->dlpi_adds + info->dlpi_subs;
+  }
+
+  return 1;
+}
+
+/* objects loaded plus objects unloaded, 0 if the loader doesn't tell */
+static uint64_t link_map_gen(void) {
+  uint64_t gen = 0;
+
+  dl_iterate_phdr(read_link_gen, &gen);
+  return gen;
+}
+
+static int next_symbol_read(next_symbol_t *slot, uint64_t gen, void *caller,
+                            const char *symbol, void **addr) {
+  unsigned int seq = 0;
+  int hit = 0;
+
+  do {
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (unlikely(seq & 1)) {
+      return 0;
+    }
+
+    /* a torn read is thrown away below, symbol stays NUL terminated */
+    hit = slot->gen == gen && slot->caller == caller &&
+          !strncmp(slot->symbol, symbol, NEXT_SYMBOL_LEN);
+    *addr = slot->addr;
+
+    atomic_thread_fence(memory_order_acquire);
+  } while (unlikely(atomic_load_explicit(&slot->seq, memory_order_relaxed) !=
+                    seq));
+
+  return hit;
+}
+
+static void next_symbol_write(next_symbol_t *slot, uint64_t gen, void *caller,
+                              const char *symbol, void *addr) {
+  unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+  if (unlikely((seq & 1) || !atomic_compare_exchange_strong_explicit(
+                                &slot->seq, &seq, seq + 1,
+                                memory_order_acquire, memory_order_relaxed))) {
+    return;
+  }
+
+  slot->gen = gen;
+  slot->caller = caller;
+  slot->addr = addr;
+  strncpy(slot->symbol, symbol, NEXT_SYMBOL_LEN - 1);
+
+  atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+static void *find_next_symbol(void *caller, const char *symbol) {
+  uint64_t gen = link_map_gen();
+  next_symbol_t *slot =
+      &next_symbols[next_symbol_key(caller, symbol) % NEXT_SYMBOL_SLOTS];
+  void *addr = NULL;
+
+  if (likely(gen && next_symbol_read(slot, gen, caller, symbol, &addr))) {
+    return addr;
+  }
+
+  addr = get_next_symbol(caller, symbol);
+
+  /* tagged with the generation seen before resolving, never newer */
+  if (likely(gen && strlen(symbol) < NEXT_SYMBOL_LEN)) {
+    next_symbol_write(slot, gen, caller, symbol, addr);
+  }
+
+  return addr;
+}
+
 EXPORT_API void *dlsym(void *handle, const char *symbol) {
   entry_t *e = NULL;
   void *entrypoint = NULL;
@@ -107,12 +259,12 @@ EXPORT_API void *dlsym(void *handle, const char *symbol) {
   BUG_ON(!__dlfcn_data.dlsym);
 
   if (unlikely(handle == RTLD_NEXT)) {
-    entrypoint = get_next_symbol(RETURN_ADDR(0), symbol);
+    entrypoint = find_next_symbol(RETURN_ADDR(0), symbol);
     goto done;
   }
 
   entrypoint = __dlfcn_data.dlsym(handle, symbol);
-  e = find_entry(get_hook_funcs_data(), get_hook_size(), symbol);
+  e = find_hook_entry(symbol);
   if (likely(e && entrypoint)) {
     e->real_pfn = entrypoint;
     if (likely(e->hook_pfn)) {
@@ -128,39 +280,386 @@ done:
   return entrypoint;
 }
 
+static int classify_uvm_fd(int fd, struct stat *st, uint32_t *minor) {
+  char path[PATH_MAX] = {0};
+  char target[sizeof(UVM_DEVICE_PATH) + 1] = {0};
+  int major = atomic_load_explicit(&uvm_major, memory_order_relaxed);
+  ssize_t n = 0;
+
+  if (major < 0) {
+    sprintf(path, "/proc/self/fd/%d", fd);
+    n = readlink(path, target, sizeof(target) - 1);
+    if (n != sizeof(UVM_DEVICE_PATH) - 1 || strcmp(target, UVM_DEVICE_PATH)) {
+      return FD_CLASS_OTHER;
+    }
+
+    major = major(st->st_rdev);
+    atomic_store_explicit(&uvm_major, major, memory_order_relaxed);
+  }
+
+  /* uvm-tools shares the major */
+  if (major(st->st_rdev) != major || minor(st->st_rdev) != UVM_DEVICE_MINOR) {
+    return FD_CLASS_OTHER;
+  }
+
+  *minor = UVM_DEVICE_MINOR;
+  return FD_CLASS_NVIDIA_UVM;
+}
+
+static int classify_fd(int fd, uint32_t *minor) {
+  struct stat st;
+
+  /* not an open fd, don't cache anything for it */
+  if (unlikely(fstat(fd, &st) < 0)) {
+    return FD_CLASS_UNKNOWN;
+  }
+
+  if ((st.st_mode & S_IFMT) != S_IFCHR) {
+    return FD_CLASS_OTHER;
+  }
+
+  if (major(st.st_rdev) != NVIDIA_DEVICE_MAJOR) {
+    return classify_uvm_fd(fd, &st, minor);
+  }
+
+  *minor = minor(st.st_rdev);
+  if (*minor == NVIDIA_CTL_MINOR) {
+    return FD_CLASS_NVIDIA_CTL;
+  }
+
+  return FD_CLASS_NVIDIA_DEVICE;
+}
+
+static int get_fd_class(int fd, uint32_t *minor) {
+  uint32_t slot = 0;
+  int class = FD_CLASS_UNKNOWN;
+
+  if (unlikely(fd < 0 || fd >= MAX_FD_CLASSES)) {
+    return classify_fd(fd, minor);
+  }
+
+  slot = atomic_load_explicit(&fd_classes[fd], memory_order_acquire);
+  class = FD_SLOT_CLASS(slot);
+  if (likely(class != FD_CLASS_UNKNOWN)) {
+    *minor = FD_SLOT_MINOR(slot);
+    return class;
+  }
+
+  class = classify_fd(fd, minor);
+  if (likely(class != FD_CLASS_UNKNOWN)) {
+    /* lose silently if the fd was closed meanwhile */
+    atomic_compare_exchange_strong(
+        &fd_classes[fd], &slot,
+        FD_SLOT(FD_SLOT_GEN(slot), class,
+                class == FD_CLASS_OTHER ? 0 : *minor));
+  }
+
+  return class;
+}
+
+static void invalidate_fd_class(int fd) {
+  uint32_t slot = 0;
+
+  if (unlikely(fd < 0 || fd >= MAX_FD_CLASSES)) {
+    return;
+  }
+
+  slot = atomic_load_explicit(&fd_classes[fd], memory_order_relaxed);
+  while (!atomic_compare_exchange_weak(
+      &fd_classes[fd], &slot,
+      FD_SLOT(FD_SLOT_GEN(slot) + 1, FD_CLASS_UNKNOWN, 0))) {
+    continue;
+  }
+}
+
+static void invalidate_fd_range(unsigned int first, unsigned int last) {
+  unsigned int fd = 0;
+
+  for (fd = first; fd <= last && fd < MAX_FD_CLASSES; fd++) {
+    invalidate_fd_class(fd);
+  }
+}
+
+/*
+ * fds closed where we can't see it, by fclose or posix_spawn file actions,
+ * leave a stale class behind. An RM escape on an fd we took for something
+ * else is worth an fstat to be sure.
+ */
+static int revalidate_fd_class(int fd, uint64_t cmd, int class,
+                               uint32_t *minor) {
+  if (likely(_IOC_TYPE(cmd) != NVIDIA_IOCTL_MAGIC)) {
+    return class;
+  }
+
+  invalidate_fd_class(fd);
+  return get_fd_class(fd, minor);
+}
+
 EXPORT_API int ioctl(int fd, uint64_t cmd, void *args) {
-  uint32_t major = 0, minor = 0;
+  ioctl_ctx_t ctx = {.cmd = cmd};
+  ioctl_handler_t *handler = NULL;
+  uint32_t classes = 0;
+  uint32_t minor = 0;
   int ret = 0;
   int success = 0;
-  device_prop_t *dev = get_device_prop();
+  int class = FD_CLASS_UNKNOWN;
 
   if (unlikely(!__dlfcn_data.ioctl)) {
     pthread_once(&__dlfcn_data.once, init);
   }
   BUG_ON(!__dlfcn_data.ioctl);
 
-  if (likely(dev->mem_limited)) {
-    ret = get_device_number(fd, &major, &minor);
-    if (unlikely(ret)) {
-      goto redirect;
+  /* the first ioctl on an nvidia fd sets up the handlers below */
+  if (unlikely(!device_prop_ready())) {
+    class = get_fd_class(fd, &minor);
+    if (class == FD_CLASS_NVIDIA_CTL || class == FD_CLASS_NVIDIA_DEVICE ||
+        class == FD_CLASS_NVIDIA_UVM) {
+      init_device_prop();
     }
+  }
+
+  /* commands nobody handles don't look at the fd */
+  classes = ioctl_handler_classes(cmd);
+  if (likely(!classes)) {
+    goto redirect;
+  }
 
-    if (unlikely(major != NVIDIA_DEVICE_MAJOR)) {
+  class = get_fd_class(fd, &minor);
+  if (unlikely(!(classes & IOCTL_CLASS(class)))) {
+    class = revalidate_fd_class(fd, cmd, class, &minor);
+    if (!(classes & IOCTL_CLASS(class))) {
       goto redirect;
     }
+  }
+
+  handler = ioctl_handler(cmd, class);
+  ctx.major = class == FD_CLASS_NVIDIA_UVM ? atomic_load(&uvm_major)
+                                           : NVIDIA_DEVICE_MAJOR;
+  ctx.minor = minor;
 
-    ret = pre_ioctl(major, minor, cmd, args, &success);
+  if (handler->pre) {
+    ret = handler->pre(&ctx, args, &success);
     if (unlikely(ret || success)) {
+      ioctl_rollback(&ctx);
       goto finish;
     }
   }
 
 redirect:
   ret = __dlfcn_data.ioctl(fd, cmd, args);
-  if (likely(dev->mem_limited && !ret)) {
-    ret = post_ioctl(major, minor, cmd, args);
+  if (handler) {
+    if (likely(!ret) && handler->post) {
+      ret = handler->post(&ctx, _IOC_SIZE(cmd), args);
+    }
+    /* anything not committed by a handler goes back to the ledger */
+    ioctl_rollback(&ctx);
   }
 
 finish:
   return ret;
 }
+
+/*
+ * fd lifetime hooks keep the classification cache coherent, they fall back
+ * to raw syscalls if they run before the real symbols are resolved
+ */
+/* the class cached for fd, without classifying it */
+static int cached_fd_class(int fd) {
+  if (unlikely(fd < 0 || fd >= MAX_FD_CLASSES)) {
+    return FD_CLASS_UNKNOWN;
+  }
+
+  return FD_SLOT_CLASS(
+      atomic_load_explicit(&fd_classes[fd], memory_order_relaxed));
+}
+
+EXPORT_API int close(int fd) {
+  int class = cached_fd_class(fd);
+  int ret = 0;
+
+  invalidate_fd_class(fd);
+  if (likely(__dlfcn_data.close)) {
+    ret = __dlfcn_data.close(fd);
+  } else {
+    ret = syscall(SYS_close, fd);
+  }
+  invalidate_fd_class(fd);
+
+  /* the managed ranges of the process go with its UVM fd */
+  if (unlikely(class == FD_CLASS_NVIDIA_UVM && !ret)) {
+    uvm_untrack_all();
+  }
+
+  return ret;
+}
+
+EXPORT_API int close_range(unsigned int first, unsigned int last,
+                           int flags) {
+  int ret = 0;
+
+  invalidate_fd_range(first, last);
+  if (likely(__dlfcn_data.close_range)) {
+    ret = __dlfcn_data.close_range(first, last, flags);
+  } else {
+#ifdef SYS_close_range
+    ret = syscall(SYS_close_range, first, last, flags);
+#else
+    errno = ENOSYS;
+    ret = -1;
+#endif
+  }
+  invalidate_fd_range(first, last);
+
+  return ret;
+}
+
+EXPORT_API void closefrom(int lowfd) {
+  if (unlikely(lowfd < 0)) {
+    lowfd = 0;
+  }
+
+  invalidate_fd_range(lowfd, ~0U);
+  if (likely(__dlfcn_data.closefrom)) {
+    __dlfcn_data.closefrom(lowfd);
+  } else {
+#ifdef SYS_close_range
+    syscall(SYS_close_range, lowfd, ~0U, 0);
+#endif
+  }
+  invalidate_fd_range(lowfd, ~0U);
+}
+
+EXPORT_API int dup(int fd) {
+  int ret = 0;
+
+  if (likely(__dlfcn_data.dup)) {
+    ret = __dlfcn_data.dup(fd);
+  } else {
+    ret = syscall(SYS_dup, fd);
+  }
+  invalidate_fd_class(ret);
+
+  return ret;
+}
+
+EXPORT_API int dup2(int fd, int fd2) {
+  int ret = 0;
+
+  invalidate_fd_class(fd2);
+  if (likely(__dlfcn_data.dup2)) {
+    ret = __dlfcn_data.dup2(fd, fd2);
+  } else if (unlikely(fd == fd2)) {
+    /* dup3 rejects equal fds, dup2 only checks that fd is valid */
+    ret = syscall(SYS_fcntl, fd, F_GETFD) < 0 ? -1 : fd2;
+  } else {
+    ret = syscall(SYS_dup3, fd, fd2, 0);
+  }
+  invalidate_fd_class(fd2);
+
+  return ret;
+}
+
+EXPORT_API int dup3(int fd, int fd2, int flags) {
+  int ret = 0;
+
+  invalidate_fd_class(fd2);
+  if (likely(__dlfcn_data.dup3)) {
+    ret = __dlfcn_data.dup3(fd, fd2, flags);
+  } else {
+    ret = syscall(SYS_dup3, fd, fd2, flags);
+  }
+  invalidate_fd_class(fd2);
+
+  return ret;
+}
+
+static int __fcntl(int fd, int cmd, void *arg) {
+  int ret = 0;
+
+  if (likely(__dlfcn_data.fcntl)) {
+    ret = __dlfcn_data.fcntl(fd, cmd, arg);
+  } else {
+    ret = syscall(SYS_fcntl, fd, cmd, arg);
+  }
+
+  if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC) {
+    invalidate_fd_class(ret);
+  }
+
+  return ret;
+}
+
+EXPORT_API int fcntl(int fd, int cmd, ...) {
+  va_list ap;
+  void *arg = NULL;
+
+  va_start(ap, cmd);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+
+  return __fcntl(fd, cmd, arg);
+}
+
+EXPORT_API int fcntl64(int fd, int cmd, ...) {
+  va_list ap;
+  void *arg = NULL;
+
+  va_start(ap, cmd);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+
+  return __fcntl(fd, cmd, arg);
+}
+
+static void *__mmap(void *addr, size_t length, int prot, int flags, int fd,
+                    off_t offset) {
+  if (likely(__dlfcn_data.mmap)) {
+    return __dlfcn_data.mmap(addr, length, prot, flags, fd, offset);
+  }
+
+  return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+/* managed ranges are mapped from the uvm fd, see uvm_hook.c */
+EXPORT_API void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+                      off_t offset) {
+  device_prop_t *dev = NULL;
+  uint32_t minor = 0;
+  void *ret = NULL;
+
+  if (likely(fd < 0 || !mem_limited() ||
+             get_fd_class(fd, &minor) != FD_CLASS_NVIDIA_UVM)) {
+    return __mmap(addr, length, prot, flags, fd, offset);
+  }
+
+  if (unlikely(uvm_pre_mmap(length, &dev))) {
+    errno = ENOMEM;
+    return MAP_FAILED;
+  }
+
+  ret = __mmap(addr, length, prot, flags, fd, offset);
+  uvm_post_mmap(dev, ret, length);
+
+  return ret;
+}
+
+EXPORT_API void *mmap64(void *addr, size_t length, int prot, int flags, int fd,
+                        off_t offset) {
+  return mmap(addr, length, prot, flags, fd, offset);
+}
+
+EXPORT_API int munmap(void *addr, size_t length) {
+  int ret = 0;
+
+  if (likely(__dlfcn_data.munmap)) {
+    ret = __dlfcn_data.munmap(addr, length);
+  } else {
+    ret = syscall(SYS_munmap, addr, length);
+  }
+
+  if (likely(!ret)) {
+    uvm_unmap((uint64_t)addr, length);
+  }
+
+  return ret;
+}
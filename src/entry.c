@@ -1,148 +1,295 @@
 #include <dlfcn.h>
 #include <link.h>
 #include <string.h>
+#include <time.h>
 
 #include "hook.h"
 
+/*
+ * libc functions we forward to. Like RTLD_NEXT, the first definition after
+ * our own object in the link map wins; objects before ours only fill in
+ * what nothing after it defines.
+ */
+#define BOOTSTRAP_SYMBOL(NAME) {#NAME, offsetof(dlfcn_t, NAME), 0}
+/* only in newer libcs, the hooks fall back to the syscall */
+#define BOOTSTRAP_OPTIONAL(NAME) {#NAME, offsetof(dlfcn_t, NAME), 1}
+
+static const struct {
+  const char *name;
+  size_t offset;
+  int optional;
+} bootstrap_symbols[] = {
+    BOOTSTRAP_SYMBOL(dlsym), BOOTSTRAP_SYMBOL(dlopen),
+    BOOTSTRAP_SYMBOL(dlclose), BOOTSTRAP_SYMBOL(dladdr),
+    BOOTSTRAP_SYMBOL(ioctl), BOOTSTRAP_SYMBOL(close),
+    BOOTSTRAP_OPTIONAL(close_range), BOOTSTRAP_OPTIONAL(closefrom),
+    BOOTSTRAP_SYMBOL(dup), BOOTSTRAP_SYMBOL(dup2),
+    BOOTSTRAP_SYMBOL(dup3), BOOTSTRAP_SYMBOL(fcntl),
+    BOOTSTRAP_SYMBOL(mmap), BOOTSTRAP_SYMBOL(munmap),
+};
+
+#define BOOTSTRAP_COUNT \
+  (sizeof(bootstrap_symbols) / sizeof(bootstrap_symbols[0]))
+
+typedef struct {
+  dlfcn_t *dlfcn;
+  size_t missing;
+  int objects;
+  /* 0 for the objects after ours, 1 for the ones before */
+  int pass;
+  int seen_self;
+} bootstrap_t;
+
+/* what the dynamic section of an object tells about its symbols */
+typedef struct {
+  ElfW(Addr) base;
+  const ElfW(Sym) *symtab;
+  const char *strtab;
+  const ElfW(Half) *versym;
+  const Elf32_Word *gnu_hash;
+  const Elf32_Word *hash;
+} dyn_info_t;
+
+static uint32_t gnu_hash(const char *name) {
+  uint32_t h = 5381;
+
+  while (*name) {
+    h = (h << 5) + h + (uint8_t)*name++;
+  }
+
+  return h;
+}
+
+static uint32_t sysv_hash(const char *name) {
+  uint32_t h = 0, g = 0;
+
+  while (*name) {
+    h = (h << 4) + (uint8_t)*name++;
+    g = h & 0xf0000000;
+    h ^= g >> 24;
+    h &= ~g;
+  }
+
+  return h;
+}
+
+/* a function definition of the default version */
+static void *symbol_addr(const dyn_info_t *dyn, uint32_t index,
+                         const char *name) {
+  const ElfW(Sym) *sym = &dyn->symtab[index];
+
+  /* ELF32_ST_TYPE and ELF64_ST_TYPE are the same */
+  if (sym->st_shndx == SHN_UNDEF || ELF64_ST_TYPE(sym->st_info) != STT_FUNC ||
+      strcmp(name, dyn->strtab + sym->st_name)) {
+    return NULL;
+  }
+
+  /* compat versions are hidden */
+  if (dyn->versym && (dyn->versym[index] & 0x8000)) {
+    return NULL;
+  }
+
+  return (void *)(dyn->base + sym->st_value);
+}
+
+static void *gnu_hash_lookup(const dyn_info_t *dyn, const char *name) {
+  const Elf32_Word *table = dyn->gnu_hash;
+  uint32_t nbuckets = table[0], symoffset = table[1];
+  uint32_t bloom_size = table[2], bloom_shift = table[3];
+  const ElfW(Addr) *bloom = (const ElfW(Addr) *)&table[4];
+  const Elf32_Word *buckets = (const Elf32_Word *)&bloom[bloom_size];
+  const Elf32_Word *chain = &buckets[nbuckets];
+  const uint32_t bits = sizeof(ElfW(Addr)) * 8;
+  uint32_t h = gnu_hash(name), h2 = 0;
+  ElfW(Addr) word = 0, mask = 0;
+  uint32_t index = 0;
+  void *addr = NULL;
+
+  if (unlikely(!nbuckets || !bloom_size)) {
+    return NULL;
+  }
+
+  /* most objects don't define the name, the bloom filter tells */
+  word = bloom[(h / bits) % bloom_size];
+  mask = ((ElfW(Addr))1 << (h % bits)) |
+         ((ElfW(Addr))1 << ((h >> bloom_shift) % bits));
+  if ((word & mask) != mask) {
+    return NULL;
+  }
+
+  index = buckets[h % nbuckets];
+  if (index < symoffset) {
+    return NULL;
+  }
+
+  do {
+    h2 = chain[index - symoffset];
+    if ((h | 1) == (h2 | 1) && (addr = symbol_addr(dyn, index, name))) {
+      return addr;
+    }
+    index++;
+  } while (!(h2 & 1));
+
+  return NULL;
+}
+
+static void *sysv_hash_lookup(const dyn_info_t *dyn, const char *name) {
+  const Elf32_Word *table = dyn->hash;
+  uint32_t nbucket = table[0];
+  const Elf32_Word *bucket = &table[2];
+  const Elf32_Word *chain = &bucket[nbucket];
+  uint32_t index = 0;
+  void *addr = NULL;
+
+  if (unlikely(!nbucket)) {
+    return NULL;
+  }
+
+  for (index = bucket[sysv_hash(name) % nbucket]; index;
+       index = chain[index]) {
+    if ((addr = symbol_addr(dyn, index, name))) {
+      return addr;
+    }
+  }
+
+  return NULL;
+}
+
+static int is_self(struct dl_phdr_info *info) {
+  ElfW(Addr) self = (ElfW(Addr))is_self;
+  ElfW(Addr) start = 0;
+  size_t i = 0;
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    if (info->dlpi_phdr[i].p_type != PT_LOAD) {
+      continue;
+    }
+
+    start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+    if (self >= start && self < start + info->dlpi_phdr[i].p_memsz) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 static int retrieve_symbols(struct dl_phdr_info *info, size_t size,
                             void *data) {
-  /* ElfW is a macro that creates proper typenames for the used system
-   * architecture (e.g. on a 32 bit system, ElfW(Dyn*) becomes "Elf32_Dyn*")
-   */
-  ElfW(Dyn *) dyn = NULL;
-  ElfW(Sym *) sym = NULL;
-  ElfW(Word *) hash = NULL;
-  ElfW(Word) sym_index = 0;
-
-  char *strtab = 0;
-  char *sym_name = 0;
-  void *sym_addr = NULL;
-  ElfW(Word) sym_cnt = 0;
-  size_t header_index = 0;
+  bootstrap_t *bootstrap = data;
   const char *libname = basename(info->dlpi_name);
-  dlfcn_t *dlfcn_data = data;
+  /* ElfW creates the typename for the architecture, e.g. Elf64_Dyn */
+  const ElfW(Dyn) *dyn = NULL;
+  dyn_info_t dyn_info = {.base = info->dlpi_addr};
+  void **slot = NULL;
+  void *addr = NULL;
+  size_t i = 0;
 
   if (unlikely(!strlen(libname) || !strcmp(libname, "linux-vdso.so.1"))) {
     return 0;
   }
 
+  /* our own definitions are the hooks */
+  if (unlikely(is_self(info))) {
+    bootstrap->seen_self = 1;
+    /* the second pass ends where the first one started */
+    return bootstrap->pass;
+  }
+
+  if (bootstrap->seen_self == bootstrap->pass) {
+    return 0;
+  }
+
+  bootstrap->objects++;
 #ifndef NDEBUG
   LOGGER(VERBOSE, "retrieve from %s base %p", info->dlpi_name,
          (void *)info->dlpi_addr);
 #endif
 
-  /* Iterate over all headers of the current shared lib
-   * (first call is for the executable itself) */
-  for (header_index = 0; header_index < info->dlpi_phnum; header_index++) {
-    if (likely(info->dlpi_phdr[header_index].p_type != PT_DYNAMIC)) {
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    if (info->dlpi_phdr[i].p_type == PT_DYNAMIC) {
+      dyn = (const ElfW(Dyn) *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+      break;
+    }
+  }
+
+  if (!dyn) {
+    return 0;
+  }
+
+  /* the loader has already relocated these to absolute addresses */
+  for (; dyn->d_tag != DT_NULL; dyn++) {
+    switch (dyn->d_tag) {
+      case DT_SYMTAB:
+        dyn_info.symtab = (const ElfW(Sym) *)dyn->d_un.d_ptr;
+        break;
+      case DT_STRTAB:
+        dyn_info.strtab = (const char *)dyn->d_un.d_ptr;
+        break;
+      case DT_VERSYM:
+        dyn_info.versym = (const ElfW(Half) *)dyn->d_un.d_ptr;
+        break;
+      case DT_GNU_HASH:
+        dyn_info.gnu_hash = (const Elf32_Word *)dyn->d_un.d_ptr;
+        break;
+      case DT_HASH:
+        dyn_info.hash = (const Elf32_Word *)dyn->d_un.d_ptr;
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (unlikely(!dyn_info.symtab || !dyn_info.strtab ||
+               (!dyn_info.gnu_hash && !dyn_info.hash))) {
+    return 0;
+  }
+
+  for (i = 0; i < BOOTSTRAP_COUNT; i++) {
+    slot = (void **)((char *)bootstrap->dlfcn + bootstrap_symbols[i].offset);
+    if (*slot) {
       continue;
     }
-    /* Further processing is only needed if the dynamic section is reached
-     */
-
-    /* Get a pointer to the first entry of the dynamic section.
-     * It's address is the shared lib's address + the virtual address */
-    dyn =
-        (ElfW(Dyn) *)(info->dlpi_addr + info->dlpi_phdr[header_index].p_vaddr);
-
-    /* Iterate over all entries of the dynamic section until the
-     * end of the symbol table is reached. This is indicated by
-     * an entry with d_tag == DT_NULL.
-     *
-     * Only the following entries need to be processed to find the
-     * symbol names:
-     *  - DT_HASH   -> second word of the hash is the number of symbols
-     *  - DT_STRTAB -> pointer to the beginning of a string table that
-     *                 contains the symbol names
-     *  - DT_SYMTAB -> pointer to the beginning of the symbols table
-     */
-    while (likely(dyn->d_tag != DT_NULL)) {
-      if (dyn->d_tag == DT_HASH) {
-        /* Get a pointer to the hash */
-        hash = (ElfW(Word *))dyn->d_un.d_ptr;
-
-        /* The 2nd word is the number of symbols */
-        sym_cnt = hash[1];
-
-      } else if (dyn->d_tag == DT_STRTAB) {
-        /* Get the pointer to the string table */
-        strtab = (char *)dyn->d_un.d_ptr;
-      } else if (dyn->d_tag == DT_SYMTAB) {
-        /* Get the pointer to the first entry of the symbol table */
-        sym = (ElfW(Sym *))dyn->d_un.d_ptr;
-
-        /* Iterate over the symbol table */
-        for (sym_index = 0; sym_index < sym_cnt; sym_index++) {
-          /* get the name of the i-th symbol.
-           * This is located at the address of st_name
-           * relative to the beginning of the string table. */
-          sym_name = &strtab[sym[sym_index].st_name];
-          sym_addr = (void *)(info->dlpi_addr + sym[sym_index].st_value);
-
-          /*
-           * if sym_addr is equal to the address of the shared lib
-           * dlpi_addr, that means it is a needed symbol
-           */
-          if (sym_addr == (void *)info->dlpi_addr) {
-            continue;
-          }
-
-          if (likely(!strcmp(sym_name, "dlsym"))) {
-            if (!dlfcn_data->dlsym) {
-              dlfcn_data->dlsym = sym_addr;
-            }
-            continue;
-          }
-
-          if (likely(!strcmp(sym_name, "dlopen"))) {
-            if (!dlfcn_data->dlopen) {
-              dlfcn_data->dlopen = sym_addr;
-            }
-            continue;
-          }
-
-          if (likely(!strcmp(sym_name, "dlclose"))) {
-            if (!dlfcn_data->dlclose) {
-              dlfcn_data->dlclose = sym_addr;
-            }
-            continue;
-          }
-
-          if (likely(!strcmp(sym_name, "dladdr"))) {
-            if (!dlfcn_data->dladdr) {
-              dlfcn_data->dladdr = sym_addr;
-            }
-            continue;
-          }
-
-          if (likely(!strcmp(sym_name, "ioctl"))) {
-            if (!dlfcn_data->ioctl) {
-              dlfcn_data->ioctl = sym_addr;
-            }
-            continue;
-          }
-        }
-      }
-
-      /* move pointer to the next entry */
-      dyn++;
+
+    addr = dyn_info.gnu_hash
+               ? gnu_hash_lookup(&dyn_info, bootstrap_symbols[i].name)
+               : sysv_hash_lookup(&dyn_info, bootstrap_symbols[i].name);
+    if (addr) {
+      *slot = addr;
+      bootstrap->missing--;
     }
   }
 
-  /* Returning something != 0 stops further iterations,
-   * since only the first entry, which is the executable itself, is needed
-   * 1 is returned after processing the first entry.
-   *
-   * If the symbols of all loaded dynamic libs shall be found,
-   * the return value has to be changed to 0.
-   */
-  return 0;
+  /* something != 0 stops the iteration, libc usually ends it */
+  return !bootstrap->missing;
 }
 
-extern void init_device_prop(void);
 extern dlfcn_t *get_dlfcn();
 
 __attribute__((constructor)) void init(void) {
-  dl_iterate_phdr(retrieve_symbols, get_dlfcn());
-  init_device_prop();
+  bootstrap_t bootstrap = {.dlfcn = get_dlfcn(), .missing = BOOTSTRAP_COUNT};
+  struct timespec start, end;
+  size_t i = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  dl_iterate_phdr(retrieve_symbols, &bootstrap);
+  if (unlikely(bootstrap.missing)) {
+    bootstrap.pass = 1;
+    bootstrap.seen_self = 0;
+    dl_iterate_phdr(retrieve_symbols, &bootstrap);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  LOGGER(VERBOSE, "bootstrap resolved %lu/%lu symbols, %d objects, %ld us",
+         BOOTSTRAP_COUNT - bootstrap.missing, BOOTSTRAP_COUNT,
+         bootstrap.objects,
+         (end.tv_sec - start.tv_sec) * 1000000L +
+             (end.tv_nsec - start.tv_nsec) / 1000);
+
+  for (i = 0; unlikely(bootstrap.missing) && i < BOOTSTRAP_COUNT; i++) {
+    if (!bootstrap_symbols[i].optional &&
+        !*(void **)((char *)bootstrap.dlfcn + bootstrap_symbols[i].offset)) {
+      LOGGER(WARN, "%s not found", bootstrap_symbols[i].name);
+    }
+  }
 }
@@ -7,15 +7,29 @@
 
 static const char *CUDA_MEM_LIMIT = "CUDA_MEM_LIMIT";
 static const char *CUDA_CORE_LIMIT = "CUDA_CORE_LIMIT";
+static const char *CUDA_MEM_LEASE = "CUDA_MEM_LEASE";
+static const char *CUDA_MEM_WAIT_MS = "CUDA_MEM_WAIT_MS";
+static const char *CUDA_NODE_SUMMARY = "CUDA_NODE_SUMMARY";
+static const char *CUDA_MEM_HISTORY_MS = "CUDA_MEM_HISTORY_MS";
+static const char *CUDA_MEM_PROFILE = "CUDA_MEM_PROFILE";
+static const char *CUDA_MEM_PROFILE_RATE = "CUDA_MEM_PROFILE_RATE";
+static const char *CUDA_CORE_PROVISIONAL_TOKENS =
+    "CUDA_CORE_PROVISIONAL_TOKENS";
 
 extern size_t iec_to_bytes(const char *iec_value);
 extern char *get_env_from(const char *str);
 
-static inline int get_limit(const char *name, uint32_t *minor, char *data) {
-  char *str = NULL;
+/*
+ * parse "<index>=<value>[,<index>=<value>...]" into per-device values,
+ * devices not listed are left at 0
+ */
+static int get_limits(const char *name, size_t *limits, int count,
+                      size_t (*parse)(const char *value)) {
+  char *str = NULL, *copy = NULL, *item = NULL, *saveptr = NULL;
+  char data[16] = {0};
+  uint32_t index = 0;
   int ret = -1;
   int n = 0;
-  uint32_t _minor = 0;
 
   str = getenv(name);
   if (unlikely(!str)) {
@@ -23,42 +37,129 @@ static inline int get_limit(const char *name, uint32_t *minor, char *data) {
     goto done;
   }
 
-  n = sscanf(str, "%u=%15s", &_minor, data);
-  if (unlikely(n != 2 || !strlen(data))) {
-    LOGGER(WARN, "empty minor or size");
+  copy = strdup(str);
+  if (unlikely(!copy)) {
     goto done;
   }
 
-  ret = 0;
-  if (likely(minor)) {
-    *minor = _minor;
+  memset(limits, 0, sizeof(size_t) * count);
+  for (item = strtok_r(copy, ",", &saveptr); item;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    memset(data, 0, sizeof(data));
+    n = sscanf(item, " %u=%15s", &index, data);
+    if (unlikely(n != 2 || !strlen(data))) {
+      LOGGER(WARN, "empty minor or size in %s", name);
+      ret = -1;
+      goto done;
+    }
+
+    if (unlikely(index >= count)) {
+      LOGGER(WARN, "device index %u of %s out of range", index, name);
+      ret = -1;
+      goto done;
+    }
+
+    limits[index] = parse(data);
+    ret = 0;
   }
+
 done:
+  free(copy);
   return ret;
 }
 
-int get_mem_limit(uint32_t *minor, size_t *limit) {
-  int ret = -1;
-  char tmp[16] = {0};
+static size_t parse_core_limit(const char *value) { return atoi(value); }
+
+int get_mem_limits(size_t *limits, int count) {
+  return get_limits(CUDA_MEM_LIMIT, limits, count, iec_to_bytes);
+}
+
+int get_core_limits(size_t *limits, int count) {
+  return get_limits(CUDA_CORE_LIMIT, limits, count, parse_core_limit);
+}
+
+/* 0 is valid, launches wait for server_monitor then */
+int get_core_provisional(size_t *tokens) {
+  char *str = NULL;
 
-  ret = get_limit(CUDA_MEM_LIMIT, minor, tmp);
-  if (unlikely(ret)) {
-    return ret;
+  str = getenv(CUDA_CORE_PROVISIONAL_TOKENS);
+  if (likely(!str || !strlen(str))) {
+    return -1;
   }
 
-  *limit = iec_to_bytes(tmp);
+  *tokens = strtoul(str, NULL, 10);
   return 0;
 }
 
-int get_core_limit(uint32_t *minor, size_t *limit) {
-  int ret = -1;
-  char tmp[16] = {0};
+int get_mem_lease(size_t *lease) {
+  char *str = NULL;
 
-  ret = get_limit(CUDA_CORE_LIMIT, minor, tmp);
-  if (unlikely(ret)) {
-    return ret;
+  str = getenv(CUDA_MEM_LEASE);
+  if (likely(!str || !strlen(str))) {
+    return -1;
   }
 
-  *limit = atoi(tmp);
+  *lease = iec_to_bytes(str);
+  return *lease ? 0 : -1;
+}
+
+int get_mem_wait(size_t *wait_ms) {
+  char *str = NULL;
+
+  str = getenv(CUDA_MEM_WAIT_MS);
+  if (likely(!str || !strlen(str))) {
+    return -1;
+  }
+
+  *wait_ms = strtoul(str, NULL, 10);
+  return *wait_ms ? 0 : -1;
+}
+
+int get_mem_history(size_t *window_ms) {
+  char *str = NULL;
+
+  str = getenv(CUDA_MEM_HISTORY_MS);
+  if (likely(!str || !strlen(str))) {
+    return -1;
+  }
+
+  *window_ms = strtoul(str, NULL, 10);
+  return *window_ms ? 0 : -1;
+}
+
+int get_node_summary(char *path, size_t len) {
+  char *str = NULL;
+
+  str = getenv(CUDA_NODE_SUMMARY);
+  if (likely(!str || !strlen(str))) {
+    return -1;
+  }
+
+  if (unlikely(strlen(str) >= len)) {
+    LOGGER(WARN, "%s too long", CUDA_NODE_SUMMARY);
+    return -1;
+  }
+
+  strcpy(path, str);
+  return 0;
+}
+
+int get_mem_profile(char *prefix, size_t len, size_t *rate) {
+  char *str = NULL;
+
+  str = getenv(CUDA_MEM_PROFILE);
+  if (likely(!str || !strlen(str))) {
+    return -1;
+  }
+
+  if (unlikely(strlen(str) >= len)) {
+    LOGGER(WARN, "%s too long", CUDA_MEM_PROFILE);
+    return -1;
+  }
+  strcpy(prefix, str);
+
+  str = getenv(CUDA_MEM_PROFILE_RATE);
+  *rate = str && strlen(str) ? iec_to_bytes(str) : 0;
+
   return 0;
 }
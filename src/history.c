@@ -0,0 +1,78 @@
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "extern.h"
+#include "hook.h"
+
+/*
+ * Usage history.
+ *
+ * With CUDA_MEM_HISTORY_MS set, every process of the container records the
+ * bytes committed on a device into a ring of time windows in the shm
+ * segment /cuda_hook_hist.<device>. A window keeps the usage at its last
+ * update and the peak over all updates, updates happen on every change to
+ * the shared ledger, so peaks shorter than the window are kept. The
+ * monitor also records once per loop, filling windows without changes.
+ *
+ * Entry values carry the low bits of their window number above the bytes,
+ * a writer reaching an entry of an older lap replaces it with a single CAS
+ * instead of resetting it first, so writers of different processes never
+ * lock. Readers take an entry as valid when the window bits of both values
+ * match its window.
+ */
+
+hist_ring_t *hist_map(uint32_t device, size_t window_ms) {
+  hist_ring_t *hist = NULL;
+  uint64_t window_nsec = 0;
+  char path[PATH_MAX] = {0};
+  share_data_t hist_share_data;
+
+  sprintf(path, HOOK_SHM_HIST_PATH_PATTERN, device);
+  hist = create_shm_addr(path, sizeof(hist_ring_t), &hist_share_data);
+  if (unlikely(!hist)) {
+    LOGGER(WARN, "create history shm addr failed");
+    return NULL;
+  }
+
+  /* the first process picks the window, the others follow it */
+  atomic_compare_exchange_strong(&hist->window_nsec, &window_nsec,
+                                 window_ms * 1000UL * 1000UL);
+  hist->slot_count = HIST_SLOTS;
+  hist->slot_size = sizeof(hist_entry_t);
+  hist->version = HIST_VERSION;
+  hist->magic = HIST_MAGIC;
+
+  return hist;
+}
+
+/* record the usage of the ledger fb_info in the current window */
+void hist_record(hist_ring_t *hist, fb_info_t *fb_info) {
+  uint64_t used = fb_info_committed(fb_info);
+  uint64_t window_nsec =
+      atomic_load_explicit(&hist->window_nsec, memory_order_relaxed);
+  uint64_t window = 0, tag = 0, value = 0, peak = 0;
+  hist_entry_t *entry = NULL;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  window = (now.tv_sec * 1000UL * 1000UL * 1000UL + now.tv_nsec) / window_nsec;
+  entry = &hist->entries[window % HIST_SLOTS];
+
+  tag = window << HIST_BYTES_BITS;
+  value = tag | (used & HIST_BYTES_MASK);
+
+  atomic_store_explicit(&entry->committed, value, memory_order_relaxed);
+
+  peak = atomic_load_explicit(&entry->peak, memory_order_relaxed);
+  while (((peak & ~HIST_BYTES_MASK) != tag || peak < value) &&
+         !atomic_compare_exchange_weak_explicit(&entry->peak, &peak, value,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+    continue;
+  }
+
+  if (atomic_load_explicit(&entry->window, memory_order_relaxed) != window) {
+    atomic_store_explicit(&entry->window, window, memory_order_release);
+  }
+}
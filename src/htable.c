@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "hook.h"
+#include "htable.h"
+
+/* keep load factor under 3/4 */
+#define HTABLE_NEED_GROW(table) \
+  (((table)->size + 1) * 4 > ((table)->mask + 1) * 3)
+
+static inline size_t htable_hash(uint64_t key) {
+  /* murmur3 finalizer, handles are small sequential numbers */
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+
+  return (size_t)key;
+}
+
+static size_t htable_round_capacity(size_t capacity) {
+  size_t n = HTABLE_MIN_CAPACITY;
+
+  while (n < capacity) {
+    n <<= 1;
+  }
+
+  return n;
+}
+
+int htable_init(htable_t *table, size_t capacity) {
+  capacity = htable_round_capacity(capacity);
+
+  table->slots = calloc(capacity, sizeof(htable_slot_t));
+  if (unlikely(!table->slots)) {
+    return -ENOMEM;
+  }
+
+  table->mask = capacity - 1;
+  table->size = 0;
+
+  return 0;
+}
+
+void htable_destroy(htable_t *table) {
+  if (likely(table->slots)) {
+    free(table->slots);
+  }
+
+  table->slots = NULL;
+  table->mask = 0;
+  table->size = 0;
+}
+
+static void htable_place(htable_slot_t *slots, size_t mask, uint64_t key,
+                         void *value) {
+  size_t i = htable_hash(key) & mask;
+
+  while (slots[i].value) {
+    i = (i + 1) & mask;
+  }
+
+  slots[i].key = key;
+  slots[i].value = value;
+}
+
+static int htable_grow(htable_t *table) {
+  size_t capacity = (table->mask + 1) << 1;
+  htable_slot_t *slots = NULL;
+  size_t i = 0;
+
+  slots = calloc(capacity, sizeof(htable_slot_t));
+  if (unlikely(!slots)) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i <= table->mask; i++) {
+    if (table->slots[i].value) {
+      htable_place(slots, capacity - 1, table->slots[i].key,
+                   table->slots[i].value);
+    }
+  }
+
+  free(table->slots);
+  table->slots = slots;
+  table->mask = capacity - 1;
+
+  return 0;
+}
+
+void *htable_find(const htable_t *table, uint64_t key) {
+  size_t i = 0;
+
+  if (unlikely(!table->slots)) {
+    return NULL;
+  }
+
+  i = htable_hash(key) & table->mask;
+  while (table->slots[i].value) {
+    if (table->slots[i].key == key) {
+      return table->slots[i].value;
+    }
+    i = (i + 1) & table->mask;
+  }
+
+  return NULL;
+}
+
+int htable_insert(htable_t *table, uint64_t key, void *value) {
+  int ret = 0;
+
+  BUG_ON(!value);
+
+  if (unlikely(!table->slots)) {
+    ret = htable_init(table, HTABLE_MIN_CAPACITY);
+    if (unlikely(ret)) {
+      return ret;
+    }
+  }
+
+  if (unlikely(htable_find(table, key))) {
+    return -EEXIST;
+  }
+
+  if (unlikely(HTABLE_NEED_GROW(table))) {
+    ret = htable_grow(table);
+    if (unlikely(ret)) {
+      return ret;
+    }
+  }
+
+  htable_place(table->slots, table->mask, key, value);
+  table->size++;
+
+  return 0;
+}
+
+void *htable_remove(htable_t *table, uint64_t key) {
+  size_t i = 0, j = 0, home = 0;
+  void *value = NULL;
+
+  if (unlikely(!table->slots)) {
+    return NULL;
+  }
+
+  i = htable_hash(key) & table->mask;
+  while (table->slots[i].value) {
+    if (table->slots[i].key == key) {
+      break;
+    }
+    i = (i + 1) & table->mask;
+  }
+
+  value = table->slots[i].value;
+  if (!value) {
+    return NULL;
+  }
+
+  /*
+   * backward shift deletion: pull following entries of the same cluster
+   * into the hole unless that would move them in front of their home slot
+   */
+  j = i;
+  while (1) {
+    j = (j + 1) & table->mask;
+    if (!table->slots[j].value) {
+      break;
+    }
+
+    home = htable_hash(table->slots[j].key) & table->mask;
+    if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+      table->slots[i] = table->slots[j];
+      i = j;
+    }
+  }
+
+  table->slots[i].key = 0;
+  table->slots[i].value = NULL;
+  table->size--;
+
+  return value;
+}
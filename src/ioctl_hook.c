@@ -1,36 +1,176 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "ctrl/ctrl2080/ctrl2080fb.h"
+#include "dispatch.h"
 #include "extern.h"
 #include "hook.h"
 #include "nv_escape.h"
 #include "nvos.h"
 #include "nvstatus.h"
 #include "nvtypes.h"
+#include "slab.h"
 // this file must be the last include file
 // clang-format off
 #include "generated/g_allclasses.h"
 // clang-format on
 
-static device_prop_t gpu_device = {
-    .mu = PTHREAD_MUTEX_INITIALIZER,
-    .major = NVIDIA_DEVICE_MAJOR,
-    .minor = NVIDIA_CTL_MINOR,
-    .alloc_mem = 0,
-    .mem_limited = 0,
-    .core_limited = 0,
+/* indexed by device id, which is also the minor of /dev/nvidia<N> */
+static device_prop_t gpu_devices[MAX_DEVICE_COUNT] = {
+    [0 ... MAX_DEVICE_COUNT - 1] =
+        {
+            .mu = PTHREAD_MUTEX_INITIALIZER,
+            .major = NVIDIA_DEVICE_MAJOR,
+            .minor = NVIDIA_CTL_MINOR,
+            .alloc_mem = 0,
+            .mem_limited = 0,
+            .core_limited = 0,
+        },
 };
 
-device_prop_t *get_device_prop(void) { return &gpu_device; }
+static pthread_once_t device_once = PTHREAD_ONCE_INIT;
+static atomic_int device_ready;
+static int mem_limited_count = 0;
+static int core_limited_count = 0;
+/* the limited device when there is exactly one, NULL otherwise */
+static device_prop_t *mem_default_device = NULL;
+static device_prop_t *core_default_device = NULL;
+
+/*
+ * device and subdevice handles of every client, hRoot -> client_arena_t of
+ * rm_mem_t, used to attribute allocations to a device through their parent
+ */
+static pthread_mutex_t rm_mem_mu = PTHREAD_MUTEX_INITIALIZER;
+static htable_t rm_arenas;
+
+static slab_cache_t rm_mem_cache = SLAB_CACHE_INIT("rm_mem", rm_mem_t);
+static slab_cache_t heap_mem_cache =
+    SLAB_CACHE_INIT("device_mem", device_mem_t);
+static slab_cache_t heap_block_cache =
+    SLAB_CACHE_INIT("heap_block", heap_block_t);
+
+device_prop_t *get_device_prop(int device_id) {
+  if (unlikely(device_id < 0 || device_id >= MAX_DEVICE_COUNT)) {
+    return NULL;
+  }
+
+  return &gpu_devices[device_id];
+}
+
+int mem_limited(void) { return mem_limited_count > 0; }
+
+/* device used by driver calls that can't tell their device */
+device_prop_t *get_mem_default_device(void) { return mem_default_device; }
+
+/* device used by kernel launches that can't tell their device */
+device_prop_t *get_core_default_device(void) { return core_default_device; }
+
+int core_limited(void) { return core_limited_count > 0; }
+
+/* fb_info segments of other devices, mapped once for FB_GET_INFO */
+typedef struct {
+  _Atomic(fb_info_t *) fb_info;
+  atomic_int owner;
+  atomic_int owner_alive;
+  atomic_uint_fast64_t checked_at;
+} fb_cache_t;
+
+#define FB_OWNER_RECHECK_NSEC (1000UL * 1000UL * 1000UL)
+
+static pthread_mutex_t fb_cache_mu = PTHREAD_MUTEX_INITIALIZER;
+static fb_cache_t fb_caches[MAX_DEVICE_COUNT];
+
+static void drain_lease(void) {
+  int i = 0;
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    if (gpu_devices[i].mem_limited) {
+      ledger_lease_drain(&gpu_devices[i]);
+    }
+  }
+}
+
+/* bytes used by the handle tracking structures themselves */
+static size_t get_tracking_mem_usage(void) {
+  slab_stats_t rm_stats, heap_stats, block_stats;
+  device_prop_t *dev = NULL;
+  size_t usage = 0;
+  int i = 0;
+
+  slab_stats(&rm_mem_cache, &rm_stats);
+  slab_stats(&heap_mem_cache, &heap_stats);
+  slab_stats(&heap_block_cache, &block_stats);
+  usage = rm_stats.reserved_bytes + heap_stats.reserved_bytes +
+          block_stats.reserved_bytes;
+
+  pthread_mutex_lock(&rm_mem_mu);
+  usage += arena_index_usage(&rm_arenas);
+  pthread_mutex_unlock(&rm_mem_mu);
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    dev = &gpu_devices[i];
+    if (!dev->mem_limited) {
+      continue;
+    }
+
+    pthread_mutex_lock(&dev->mu);
+    usage += arena_index_usage(&dev->heap_arenas);
+    pthread_mutex_unlock(&dev->mu);
+  }
+
+  return usage;
+}
+
+/* slab chunks are never returned, so this is the peak of the process */
+static void report_tracking_mem_usage(void) {
+  LOGGER(VERBOSE, "handle tracking used %lu bytes",
+         get_tracking_mem_usage());
+}
+
+/* launches allowed before server_monitor publishes the parameters */
+#define CORE_PROVISIONAL_TOKENS 16
+
+/*
+ * wait for server_monitor to publish the parameters, launches spend the
+ * provisional tokens meanwhile and then block on the token semaphore
+ */
+static void token_wait_ready(device_prop_t *dev) {
+  token_attr_t *attr = dev->attr;
+  struct timespec deadline;
+  int tokens = 0;
+
+  if (likely(atomic_load(&attr->inited))) {
+    return;
+  }
+
+  LOGGER(VERBOSE, "device %u waits for server monitor", dev->minor);
+  while (!atomic_load(&attr->inited)) {
+    /* another process may re-init ready and lose our post, so poll too */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    sem_timedwait(&attr->ready, &deadline);
+  }
+
+  /* top up to the budget a process gets when the monitor is already up */
+  sem_getvalue(&dev->tokens, &tokens);
+  for (; tokens < attr->params.core_limit; tokens++) {
+    sem_post(&dev->tokens);
+  }
+
+  LOGGER(VERBOSE, "device %u server monitor ready, core limit %d", dev->minor,
+         attr->params.core_limit);
+}
 
 void *token_post(void *arg) {
   device_prop_t *dev = arg;
@@ -41,8 +181,12 @@ void *token_post(void *arg) {
   int32_t launch_times[LAUNCH_SAMPLES] = {0};
   int32_t sum_launch = 0;
 
+  token_wait_ready(dev);
+
   LOGGER(VERBOSE, "start token post");
   dev_params = &dev->attr->params;
+  interval.tv_nsec = dev->attr->wait_time.tv_nsec;
+  params.add_per_cycle = atomic_load(&dev_params->add_per_cycle);
   while (1) {
     loop++;
     if (unlikely(atomic_load(&dev->attr->changed))) {
@@ -75,12 +219,179 @@ void *token_post(void *arg) {
   }
 }
 
-int pre_vid_heap_alloc(uint32_t cmd, void *arg, int *success) {
+/* must be called with rm_mem_mu held */
+static int track_device_handle(uint32_t root, uint32_t object,
+                               uint32_t device_id) {
+  client_arena_t *arena = NULL;
+  rm_mem_t *entry = NULL;
+  int ret = 0;
+
+  arena = arena_get(&rm_arenas, root);
+  if (unlikely(!arena)) {
+    return -ENOMEM;
+  }
+
+  entry = slab_alloc(&rm_mem_cache);
+  if (unlikely(!entry)) {
+    return -ENOMEM;
+  }
+
+  entry->root = root;
+  entry->object = object;
+  entry->device_id = device_id;
+
+  ret = htable_insert(&arena->objects, object, entry);
+  if (unlikely(ret)) {
+    LOGGER(WARN, "track device handle 0x%x:0x%x failed %d", root, object, ret);
+    slab_free(&rm_mem_cache, entry);
+  }
+
+  return ret;
+}
+
+int free_heap_page(device_prop_t *dev, uint32_t root, uint32_t page);
+void ioctl_rollback(ioctl_ctx_t *ctx);
+int pre_rm_control(ioctl_ctx_t *ctx, void *arg, int *success);
+
+/*
+ * drop the reference of a heap handle to its block, returns the bytes to
+ * credit back, 0 while other handles still share the block. Must be called
+ * with the device mu held.
+ */
+static size_t put_heap_block(device_mem_t *entry) {
+  heap_block_t *block = entry->block;
+  size_t size = 0;
+
+  entry->block = NULL;
+  if (--block->refs) {
+    return 0;
+  }
+
+  size = block->size;
+  prof_free(block->site, size);
+  slab_free(&heap_block_cache, block);
+
+  return size;
+}
+
+/* add a handle referencing block to the arena of root, takes a reference */
+static int insert_heap_handle(device_prop_t *dev, uint32_t root,
+                              uint32_t object, heap_block_t *block) {
+  client_arena_t *arena = NULL;
+  device_mem_t *entry = NULL;
+  int ret = 0;
+
+  arena = arena_get(&dev->heap_arenas, root);
+  if (unlikely(!arena)) {
+    return -ENOMEM;
+  }
+
+  entry = slab_alloc(&heap_mem_cache);
+  if (unlikely(!entry)) {
+    return -ENOMEM;
+  }
+
+  entry->root = root;
+  entry->object = object;
+  entry->size = block->size;
+  entry->block = block;
+
+  ret = htable_insert(&arena->objects, object, entry);
+  if (unlikely(ret == -EEXIST)) {
+    /* handle reused without us seeing the free, drop the stale one */
+    free_heap_page(dev, root, object);
+    ret = htable_insert(&arena->objects, object, entry);
+  }
+
+  if (unlikely(ret)) {
+    LOGGER(WARN, "track heap handle 0x%x:0x%x failed %d", root, object, ret);
+    slab_free(&heap_mem_cache, entry);
+    return ret;
+  }
+
+  block->refs++;
+
+  return 0;
+}
+
+/*
+ * commit the bytes reserved in pre_ioctl to a new heap handle of ctx->dev,
+ * must be called with ctx->dev->mu held. site is sampled by the caller
+ * before taking the lock, the unwinder takes loader locks of its own.
+ */
+static int track_heap_handle(uint32_t root, uint32_t object, ioctl_ctx_t *ctx,
+                             prof_site_t *site) {
+  device_prop_t *dev = ctx->dev;
+  heap_block_t *block = NULL;
+  int ret = 0;
+
+  block = slab_alloc(&heap_block_cache);
+  if (unlikely(!block)) {
+    return -ENOMEM;
+  }
+
+  block->size = ctx->reserved;
+  block->refs = 0;
+  block->site = NULL;
+
+  ret = insert_heap_handle(dev, root, object, block);
+  if (unlikely(ret)) {
+    slab_free(&heap_block_cache, block);
+    return ret;
+  }
+
+  ctx->reserved = 0;
+  block->site = site;
+  dev->alloc_mem += block->size;
+  watermark_check(dev);
+
+  return 0;
+}
+
+static int find_device_id(uint32_t root, uint32_t object) {
+  rm_mem_t *entry = NULL;
+  int device_id = -1;
+
+  pthread_mutex_lock(&rm_mem_mu);
+  entry = arena_find_object(&rm_arenas, root, object);
+  if (entry) {
+    device_id = entry->device_id;
+  }
+  pthread_mutex_unlock(&rm_mem_mu);
+
+  return device_id;
+}
+
+/*
+ * memory is allocated under a device or subdevice handle, follow the parent
+ * to the limited device it belongs to. Parents we never saw can only be
+ * attributed when a single device is limited.
+ */
+static device_prop_t *find_device(uint32_t root, uint32_t parent) {
+  int device_id = -1;
+
+  device_id = find_device_id(root, parent);
+  if (device_id >= 0 && device_id < MAX_DEVICE_COUNT) {
+    return gpu_devices[device_id].mem_limited ? &gpu_devices[device_id]
+                                              : NULL;
+  }
+
+  return mem_default_device;
+}
+
+int pre_vid_heap_alloc(ioctl_ctx_t *ctx, void *arg, int *success) {
   NVOS32_PARAMETERS *pApi = arg;
+  device_prop_t *dev = NULL;
   size_t align_size = 0;
   int ret = 0;
 
   *success = 0;
+
+  dev = find_device(pApi->hRoot, pApi->hObjectParent);
+  if (!dev) {
+    goto finish;
+  }
+
   switch (pApi->function) {
     case NVOS32_FUNCTION_ALLOC_SIZE:
       if (likely(pApi->data.AllocSize.alignment != 0)) {
@@ -88,35 +399,55 @@ int pre_vid_heap_alloc(uint32_t cmd, void *arg, int *success) {
             (pApi->data.AllocSize.size + pApi->data.AllocSize.alignment - 1) &
             ~(pApi->data.AllocSize.alignment - 1);
 
-        pthread_mutex_lock(&gpu_device.mu);
-        if (gpu_device.fb_info->free_mem < align_size) {
+        if (ledger_reserve(dev, align_size)) {
           pApi->status = NV_ERR_NO_MEMORY;
-          pApi->total = gpu_device.fb_info->total_mem;
-          pApi->free = gpu_device.fb_info->free_mem;
+          pApi->total = dev->fb_info->total_mem;
+          pApi->free = ledger_free_mem(dev);
           *success = 1;
+        } else {
+          ctx->dev = dev;
+          ctx->reserved = align_size;
         }
-        pthread_mutex_unlock(&gpu_device.mu);
       }
       break;
     case NVOS32_FUNCTION_INFO:
-      pthread_mutex_lock(&gpu_device.mu);
-      if (gpu_device.fb_info->free_mem < align_size) {
+      if (ledger_free_mem(dev) < align_size) {
         pApi->status = NV_ERR_NO_MEMORY;
-        pApi->total = gpu_device.fb_info->total_mem;
-        pApi->free = gpu_device.fb_info->free_mem;
+        pApi->total = dev->fb_info->total_mem;
+        pApi->free = ledger_free_mem(dev);
       }
-      pthread_mutex_unlock(&gpu_device.mu);
       break;
     default:
       break;
   }
 
+finish:
   return ret;
 }
 
-int pre_rm_alloc(uint32_t cmd, void *arg, int *success) {
+/* reserve the bytes of a memory object allocated under parent */
+static void pre_memory_rm_alloc(ioctl_ctx_t *ctx, NVOS21_PARAMETERS *pApi,
+                                size_t size, int *success) {
+  device_prop_t *dev = NULL;
+
+  dev = find_device(pApi->hRoot, pApi->hObjectParent);
+  if (!dev) {
+    return;
+  }
+
+  if (ledger_reserve(dev, size)) {
+    pApi->status = NV_ERR_NO_MEMORY;
+    *success = 1;
+  } else {
+    ctx->dev = dev;
+    ctx->reserved = size;
+  }
+}
+
+int pre_rm_alloc(ioctl_ctx_t *ctx, void *arg, int *success) {
   NVOS21_PARAMETERS *pApi = arg;
   NV_MEMORY_ALLOCATION_PARAMS *params = NULL;
+  NV_PHYSICAL_MEMORY_ALLOCATION_PARAMS *phys_params = NULL;
   size_t align_size = 0;
   int ret = 0;
 
@@ -133,34 +464,15 @@ int pre_rm_alloc(uint32_t cmd, void *arg, int *success) {
       if (likely(params->alignment != 0)) {
         align_size =
             (params->size + params->alignment - 1) & ~(params->alignment - 1);
-
-        pthread_mutex_lock(&gpu_device.mu);
-        if (gpu_device.fb_info->free_mem < align_size) {
-          pApi->status = NV_ERR_NO_MEMORY;
-          *success = 1;
-        }
-        pthread_mutex_unlock(&gpu_device.mu);
+        pre_memory_rm_alloc(ctx, pApi, align_size, success);
       }
       break;
-    default:
-      break;
-  }
-
-  return ret;
-}
-
-int pre_ioctl(uint32_t major, uint32_t minor, uint32_t cmd, void *arg,
-              int *success) {
-  int arg_cmd = 0;
-  int ret = 0;
-
-  arg_cmd = _IOC_NR(cmd);
-  switch (arg_cmd) {
-    case NV_ESC_RM_VID_HEAP_CONTROL:
-      ret = pre_vid_heap_alloc(cmd, arg, success);
-      break;
-    case NV_ESC_RM_ALLOC:
-      ret = pre_rm_alloc(cmd, arg, success);
+      /* physical backing of cuMemCreate and stream-ordered pools */
+    case NV01_MEMORY_LOCAL_PHYSICAL:
+      phys_params = pApi->pAllocParms;
+      if (likely(phys_params && phys_params->memSize)) {
+        pre_memory_rm_alloc(ctx, pApi, phys_params->memSize, success);
+      }
       break;
     default:
       break;
@@ -172,27 +484,15 @@ int pre_ioctl(uint32_t major, uint32_t minor, uint32_t cmd, void *arg,
 int post_device_rm_alloc(NVOS21_PARAMETERS *pApi) {
   int ret = 0;
   int32_t device_id = -1;
-  rm_mem_t *entry = NULL;
 
   device_id = *(int *)pApi->pAllocParms;
 #ifndef NDEBUG
   LOGGER(VERBOSE, "allocate struct of device id: %d", device_id);
 #endif
 
-  pthread_mutex_lock(&gpu_device.mu);
-
-  entry = malloc(sizeof(rm_mem_t));
-  if (unlikely(!entry)) {
-    ret = -ENOMEM;
-    goto finish;
-  }
-
-  entry->object = pApi->hObjectNew;
-  entry->device_id = device_id;
-  list_add(&entry->node, &gpu_device.rm_mem_list);
-
-finish:
-  pthread_mutex_unlock(&gpu_device.mu);
+  pthread_mutex_lock(&rm_mem_mu);
+  ret = track_device_handle(pApi->hRoot, pApi->hObjectNew, device_id);
+  pthread_mutex_unlock(&rm_mem_mu);
 
   return ret;
 }
@@ -201,85 +501,61 @@ int post_ctrl_rm_alloc(NVOS21_PARAMETERS *pApi) {
   int ret = 0;
   int32_t device_id = -1;
   rm_mem_t *entry = NULL;
-  struct list_head *iter = NULL;
 
 #ifndef NDEBUG
   LOGGER(VERBOSE, "allocate ctrl param, parent: %p", pApi->hObjectParent);
 #endif
-  pthread_mutex_lock(&gpu_device.mu);
+  pthread_mutex_lock(&rm_mem_mu);
 
-  list_for_each(iter, &gpu_device.rm_mem_list) {
-    entry = container_of(iter, rm_mem_t, node);
-    if (entry->object == pApi->hObjectParent) {
-      device_id = entry->device_id;
-      break;
-    }
-  }
-
-  if (device_id == -1) {
+  entry = arena_find_object(&rm_arenas, pApi->hRoot, pApi->hObjectParent);
+  if (!entry) {
     goto finish;
   }
+  device_id = entry->device_id;
 
 #ifndef NDEBUG
   LOGGER(VERBOSE, "allocate ctrl param on device %d", device_id);
 #endif
 
-  entry = malloc(sizeof(rm_mem_t));
-  if (unlikely(!entry)) {
-    ret = -ENOMEM;
-    goto finish;
-  }
-
-  entry->object = pApi->hObjectNew;
-  entry->device_id = device_id;
-  list_add(&entry->node, &gpu_device.rm_mem_list);
+  ret = track_device_handle(pApi->hRoot, pApi->hObjectNew, device_id);
 
 finish:
-  pthread_mutex_unlock(&gpu_device.mu);
+  pthread_mutex_unlock(&rm_mem_mu);
 
   return ret;
 }
 
-int post_memory_rm_alloc(NVOS21_PARAMETERS *pApi) {
+int post_memory_rm_alloc(ioctl_ctx_t *ctx, NVOS21_PARAMETERS *pApi) {
   int ret = 0;
-  device_mem_t *entry = NULL;
-  NV_MEMORY_ALLOCATION_PARAMS *params = NULL;
+  device_prop_t *dev = ctx->dev;
+  prof_site_t *site = NULL;
+  size_t size = ctx->reserved;
 
-  if (unlikely(pApi->status != NV_OK)) {
+  /* nothing was reserved for allocations we don't charge */
+  if (unlikely(!dev || !ctx->reserved || pApi->status != NV_OK)) {
     goto finish;
   }
 
-  params = pApi->pAllocParms;
-
-  if (unlikely(params->alignment == 0)) {
-    goto finish;
-  }
-
-  pthread_mutex_lock(&gpu_device.mu);
-  entry = malloc(sizeof(device_mem_t));
-  if (unlikely(!entry)) {
-    ret = -ENOMEM;
-    goto finish;
-  }
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "alloc from rm: %p, device: %u, class: 0x%x, size: %lu",
+         pApi->hObjectNew, dev->minor, pApi->hClass, ctx->reserved);
+#endif
 
-  entry->object = params->owner;
-  entry->size = params->size;
-  list_add(&entry->node, &gpu_device.heap_mem_list);
+  site = prof_alloc(ctx->reserved);
 
-  gpu_device.fb_info->free_mem -= entry->size;
-  gpu_device.alloc_mem += entry->size;
-  pthread_mutex_unlock(&gpu_device.mu);
+  pthread_mutex_lock(&dev->mu);
+  ret = track_heap_handle(pApi->hRoot, pApi->hObjectNew, ctx, site);
+  pthread_mutex_unlock(&dev->mu);
 
-#ifndef NDEBUG
-  LOGGER(VERBOSE, "alloc from rm: %p, size: %lu, use: %lu", params->owner,
-         params->size, gpu_device.alloc_mem);
-#endif
+  if (unlikely(ret)) {
+    prof_free(site, size);
+  }
 
 finish:
   return ret;
 }
 
-int post_rm_alloc(uint32_t minor, size_t arg_size, void *arg) {
+int post_rm_alloc(ioctl_ctx_t *ctx, size_t arg_size, void *arg) {
   int ret = 0;
   NVOS21_PARAMETERS *pApi = arg;
 
@@ -296,7 +572,8 @@ int post_rm_alloc(uint32_t minor, size_t arg_size, void *arg) {
       ret = post_ctrl_rm_alloc(pApi);
       break;
     case NV01_MEMORY_LOCAL_USER:
-      ret = post_memory_rm_alloc(pApi);
+    case NV01_MEMORY_LOCAL_PHYSICAL:
+      ret = post_memory_rm_alloc(ctx, pApi);
       break;
     default:
       break;
@@ -305,11 +582,13 @@ int post_rm_alloc(uint32_t minor, size_t arg_size, void *arg) {
   return ret;
 }
 
-int post_vid_heap_alloc(NVOS32_PARAMETERS *pApi) {
+int post_vid_heap_alloc(ioctl_ctx_t *ctx, NVOS32_PARAMETERS *pApi) {
   int ret = 0;
-  device_mem_t *entry = NULL;
+  device_prop_t *dev = ctx->dev;
+  prof_site_t *site = NULL;
+  size_t size = ctx->reserved;
 
-  if (unlikely(pApi->status != NV_OK)) {
+  if (unlikely(!dev || pApi->status != NV_OK)) {
     goto finish;
   }
 
@@ -317,40 +596,36 @@ int post_vid_heap_alloc(NVOS32_PARAMETERS *pApi) {
     goto finish;
   }
 
-  pthread_mutex_lock(&gpu_device.mu);
-  entry = malloc(sizeof(device_mem_t));
-  if (unlikely(!entry)) {
-    ret = -ENOMEM;
-    goto finish;
-  }
+  site = prof_alloc(size);
 
-  entry->object = pApi->data.AllocSize.hMemory;
-  entry->size = pApi->data.AllocSize.size;
-  list_add(&entry->node, &gpu_device.heap_mem_list);
+  pthread_mutex_lock(&dev->mu);
+  ret = track_heap_handle(pApi->hRoot, pApi->data.AllocSize.hMemory, ctx,
+                          site);
 
-  gpu_device.fb_info->free_mem -= entry->size;
-  gpu_device.alloc_mem += entry->size;
+  pApi->total = dev->fb_info->total_mem;
+  pApi->free = ledger_free_mem(dev);
 
-  pApi->total = gpu_device.fb_info->total_mem;
-  pApi->free = gpu_device.fb_info->free_mem;
+  pthread_mutex_unlock(&dev->mu);
 
-  pthread_mutex_unlock(&gpu_device.mu);
+  if (unlikely(ret)) {
+    prof_free(site, size);
+  }
 
 #ifndef NDEBUG
-  LOGGER(VERBOSE, "alloc from heap: %p, size: %lu, use: %lu",
-         pApi->data.AllocSize.hMemory, pApi->data.AllocSize.size,
-         gpu_device.alloc_mem);
+  LOGGER(VERBOSE, "alloc from heap: %p, device: %u, size: %lu, use: %lu",
+         pApi->data.AllocSize.hMemory, dev->minor, pApi->data.AllocSize.size,
+         dev->alloc_mem);
 #endif
 
 finish:
   return ret;
 }
 
-int post_rm_vid_heap_control(uint32_t minor, size_t arg_size, void *arg) {
+int post_rm_vid_heap_control(ioctl_ctx_t *ctx, size_t arg_size, void *arg) {
   int ret = 0;
   NVOS32_PARAMETERS *pApi = arg;
 
-  if (unlikely(minor != NVIDIA_CTL_MINOR)) {
+  if (unlikely(ctx->minor != NVIDIA_CTL_MINOR)) {
     ret = -EINVAL;
     goto finish;
   }
@@ -361,7 +636,7 @@ int post_rm_vid_heap_control(uint32_t minor, size_t arg_size, void *arg) {
       LOGGER(VERBOSE, "vid heap alloc parent: %p, root: %p",
              pApi->hObjectParent, pApi->hRoot);
 #endif
-      ret = post_vid_heap_alloc(pApi);
+      ret = post_vid_heap_alloc(ctx, pApi);
       break;
     default:
       break;
@@ -371,75 +646,173 @@ finish:
   return ret;
 }
 
+static fb_info_t *map_fb_info(int device_id) {
+  fb_cache_t *cache = &fb_caches[device_id];
+  fb_info_t *fb_info = NULL;
+  char path[PATH_MAX] = {0};
+  share_data_t fb_share_data = {.fd = -1, .addr = NULL};
+
+  fb_info = atomic_load_explicit(&cache->fb_info, memory_order_acquire);
+  if (likely(fb_info)) {
+    return fb_info;
+  }
+
+  pthread_mutex_lock(&fb_cache_mu);
+  fb_info = atomic_load_explicit(&cache->fb_info, memory_order_relaxed);
+  if (fb_info) {
+    goto finish;
+  }
+
+  if (gpu_devices[device_id].mem_limited) {
+    fb_info = gpu_devices[device_id].fb_info;
+  } else {
+    sprintf(path, HOOK_SHM_FB_MEM_PATH_PATTERN, device_id);
+    fb_info = create_shm_addr(path, sizeof(fb_info_t), &fb_share_data);
+    /* the mapping outlives the fd */
+    if (fb_share_data.fd >= 0) {
+      close(fb_share_data.fd);
+    }
+  }
+
+  if (likely(fb_info)) {
+    atomic_store_explicit(&cache->fb_info, fb_info, memory_order_release);
+  }
+
+finish:
+  pthread_mutex_unlock(&fb_cache_mu);
+  return fb_info;
+}
+
+/*
+ * the owner liveness is cached and revalidated when the owner changes or
+ * once FB_OWNER_RECHECK_NSEC passed, the clock read is served by the vdso
+ */
+static int fb_owner_alive(fb_cache_t *cache, pid_t pid) {
+  struct timespec now;
+  uint64_t now_ns = 0, checked = 0;
+  int alive = 0;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  now_ns = now.tv_sec * 1000UL * 1000UL * 1000UL + now.tv_nsec;
+
+  checked = atomic_load_explicit(&cache->checked_at, memory_order_acquire);
+  if (likely(atomic_load_explicit(&cache->owner, memory_order_relaxed) == pid &&
+             checked && now_ns - checked < FB_OWNER_RECHECK_NSEC)) {
+    return atomic_load_explicit(&cache->owner_alive, memory_order_relaxed);
+  }
+
+  alive = pid == getpid() || kill(pid, 0) == 0 || errno == EPERM;
+  atomic_store_explicit(&cache->owner, pid, memory_order_relaxed);
+  atomic_store_explicit(&cache->owner_alive, alive, memory_order_relaxed);
+  atomic_store_explicit(&cache->checked_at, now_ns, memory_order_release);
+
+  return alive;
+}
+
 int __get_fb_info(int device_id, size_t *total_mem, size_t *free_mem) {
   int ret = 0;
-  char path[PATH_MAX] = {0};
-  share_data_t fb_share_data;
-  char lpath[PATH_MAX] = {0};
   fb_info_t *fb_info = NULL;
+  pid_t pid = 0;
 
   *total_mem = 0;
   *free_mem = -1;
 
-  sprintf(path, HOOK_SHM_FB_MEM_PATH_PATTERN, device_id);
-  fb_info = create_shm_addr(path, sizeof(fb_info_t), &fb_share_data);
+  if (unlikely(device_id < 0 || device_id >= MAX_DEVICE_COUNT)) {
+    goto finish;
+  }
+
+  fb_info = map_fb_info(device_id);
   if (unlikely(!fb_info)) {
     goto finish;
   }
 
-  if (fb_info->pid == 0) {
+  pid = fb_info->pid;
+  if (pid == 0) {
     goto finish;
   }
 
   *total_mem = fb_info->total_mem >> 10;
 
   /* if fb_info->pid existed, use its free_mem value */
-  sprintf(path, "/proc/%d/exe", fb_info->pid);
-  if (readlink(path, lpath, PATH_MAX - 1) == 0) {
-    *free_mem = fb_info->free_mem >> 10;
+  if (fb_owner_alive(&fb_caches[device_id], pid)) {
+    if (gpu_devices[device_id].mem_limited) {
+      *free_mem = ledger_free_mem(&gpu_devices[device_id]) >> 10;
+    } else {
+      *free_mem = atomic_load(&fb_info->free_mem) >> 10;
+    }
   }
 
 finish:
-  if (fb_share_data.addr) {
-    munmap(fb_share_data.addr, sizeof(fb_info_t));
+  return ret;
+}
+
+/* resolve the info list of a FB_GET_INFO(_V2) control, -1 for other cmds */
+static int get_fb_info_list(uint32_t cmd, void *params, size_t param_size,
+                            NV2080_CTRL_FB_INFO **list, uint32_t *count) {
+  NV2080_CTRL_FB_GET_INFO_PARAMS *pParams = params;
+  NV2080_CTRL_FB_GET_INFO_V2_PARAMS *pParamsV2 = params;
+
+  if (unlikely(!params)) {
+    return -1;
   }
 
-  if (fb_share_data.fd) {
-    close(fb_share_data.fd);
+  switch (cmd) {
+      /* 0x20801301 */
+    case NV2080_CTRL_CMD_FB_GET_INFO:
+      if (unlikely(param_size < sizeof(*pParams) || !pParams->fbInfoList)) {
+        return -1;
+      }
+      *list = (NV2080_CTRL_FB_INFO *)(pParams->fbInfoList);
+      *count = pParams->fbInfoListSize;
+      return 0;
+      /* 0x20801303 */
+    case NV2080_CTRL_CMD_FB_GET_INFO_V2:
+      if (unlikely(param_size < sizeof(*pParamsV2) ||
+                   pParamsV2->fbInfoListSize >
+                       NV2080_CTRL_FB_INFO_MAX_LIST_SIZE)) {
+        return -1;
+      }
+      *list = pParamsV2->fbInfoList;
+      *count = pParamsV2->fbInfoListSize;
+      return 0;
+    default:
+      break;
   }
 
-  return ret;
+  return -1;
 }
 
-int post_rm_control_fb_get_info(uint32_t handle, void *params,
-                                size_t param_size) {
-  int ret = 0;
-  NV2080_CTRL_FB_GET_INFO_PARAMS *pParams = params;
-  NV2080_CTRL_FB_INFO *info = NULL;
-  int i = 0;
-  struct list_head *iter = NULL;
-  rm_mem_t *entry = NULL;
-  int device_id = -1;
-  size_t total_mem = 0, free_mem = 0;
+/* whether every requested index is one we answer from the ledger */
+static int fb_info_list_virtualized(NV2080_CTRL_FB_INFO *list,
+                                    uint32_t count) {
+  uint32_t i = 0;
 
-  pthread_mutex_lock(&gpu_device.mu);
-  list_for_each(iter, &gpu_device.rm_mem_list) {
-    entry = container_of(iter, rm_mem_t, node);
-    if (entry->object == handle) {
-      device_id = entry->device_id;
-      break;
-    }
+  if (unlikely(!count)) {
+    return 0;
   }
-  pthread_mutex_unlock(&gpu_device.mu);
 
-  if (device_id == -1) {
-    goto finish;
+  for (i = 0; i < count; i++) {
+    switch (list[i].index) {
+      case NV2080_CTRL_FB_INFO_INDEX_TOTAL_RAM_SIZE:
+      case NV2080_CTRL_FB_INFO_INDEX_HEAP_SIZE:
+      case NV2080_CTRL_FB_INFO_INDEX_HEAP_FREE:
+        break;
+      default:
+        return 0;
+    }
   }
 
-  __get_fb_info(device_id, &total_mem, &free_mem);
+  return 1;
+}
+
+static void patch_fb_info_list(NV2080_CTRL_FB_INFO *list, uint32_t count,
+                               size_t total_mem, size_t free_mem) {
+  NV2080_CTRL_FB_INFO *info = NULL;
+  uint32_t i = 0;
+
+  for (i = 0; i < count; i++) {
+    info = &list[i];
 
-  for (i = 0; i < pParams->fbInfoListSize; i++) {
-    info = ((NV2080_CTRL_FB_INFO *)(pParams->fbInfoList) + i);
     switch (info->index) {
       case NV2080_CTRL_FB_INFO_INDEX_TOTAL_RAM_SIZE:
       case NV2080_CTRL_FB_INFO_INDEX_HEAP_SIZE:
@@ -453,64 +826,76 @@ int post_rm_control_fb_get_info(uint32_t handle, void *params,
         break;
     }
   }
-
-finish:
-  return ret;
 }
 
-int post_rm_control_fb_get_info_v2(uint32_t handle, void *params,
-                                   size_t param_size) {
-  int ret = 0;
-  NV2080_CTRL_FB_GET_INFO_V2_PARAMS *pParams = params;
-  NV2080_CTRL_FB_INFO *info = NULL;
-  int i = 0;
-  struct list_head *iter = NULL;
-  rm_mem_t *entry = NULL;
+/*
+ * answer memory-only FB_GET_INFO queries from the ledger so they never
+ * reach the driver, anything else goes through post_rm_control
+ */
+int pre_rm_control(ioctl_ctx_t *ctx, void *arg, int *success) {
+  NVOS54_PARAMETERS *pApi = arg;
+  NV2080_CTRL_FB_INFO *list = NULL;
+  uint32_t count = 0;
   int device_id = -1;
   size_t total_mem = 0, free_mem = 0;
 
-  pthread_mutex_lock(&gpu_device.mu);
-  list_for_each(iter, &gpu_device.rm_mem_list) {
-    entry = container_of(iter, rm_mem_t, node);
-    if (entry->object == handle) {
-      device_id = entry->device_id;
-      break;
-    }
+  *success = 0;
+
+  if (unlikely(ctx->minor != NVIDIA_CTL_MINOR)) {
+    return 0;
   }
-  pthread_mutex_unlock(&gpu_device.mu);
 
+  if (likely(get_fb_info_list(pApi->cmd, pApi->params, pApi->paramsSize,
+                              &list, &count))) {
+    return 0;
+  }
+
+  if (!fb_info_list_virtualized(list, count)) {
+    return 0;
+  }
+
+  device_id = find_device_id(pApi->hClient, pApi->hObject);
   if (device_id == -1) {
-    goto finish;
+    return 0;
   }
 
   __get_fb_info(device_id, &total_mem, &free_mem);
+  if (!total_mem) {
+    return 0;
+  }
 
-  for (i = 0; i < pParams->fbInfoListSize; i++) {
-    info = &pParams->fbInfoList[i];
+  patch_fb_info_list(list, count, total_mem, free_mem);
+  pApi->status = NV_OK;
+  *success = 1;
 
-    switch (info->index) {
-      case NV2080_CTRL_FB_INFO_INDEX_TOTAL_RAM_SIZE:
-      case NV2080_CTRL_FB_INFO_INDEX_HEAP_SIZE:
-        info->data = total_mem > 0 ? total_mem : info->data;
-        break;
-      case NV2080_CTRL_FB_INFO_INDEX_HEAP_FREE:
-        info->data = free_mem != -1 ? free_mem
-                                    : (total_mem > 0 ? total_mem : info->data);
-        break;
-      default:
-        break;
-    }
+  return 0;
+}
+
+int post_rm_control_fb_get_info(uint32_t client, uint32_t handle,
+                                NV2080_CTRL_FB_INFO *list, uint32_t count) {
+  int ret = 0;
+  int device_id = -1;
+  size_t total_mem = 0, free_mem = 0;
+
+  device_id = find_device_id(client, handle);
+  if (device_id == -1) {
+    goto finish;
   }
 
+  __get_fb_info(device_id, &total_mem, &free_mem);
+  patch_fb_info_list(list, count, total_mem, free_mem);
+
 finish:
   return ret;
 }
 
-int post_rm_control(uint32_t minor, size_t arg_size, void *arg) {
+int post_rm_control(ioctl_ctx_t *ctx, size_t arg_size, void *arg) {
   int ret = 0;
   NVOS54_PARAMETERS *pApi = arg;
+  NV2080_CTRL_FB_INFO *list = NULL;
+  uint32_t count = 0;
 
-  if (unlikely(minor != NVIDIA_CTL_MINOR)) {
+  if (unlikely(ctx->minor != NVIDIA_CTL_MINOR)) {
     ret = -EINVAL;
     goto finish;
   }
@@ -519,80 +904,167 @@ int post_rm_control(uint32_t minor, size_t arg_size, void *arg) {
     goto finish;
   }
 
-  switch (pApi->cmd) {
-      /* 0x20801301 */
-    case NV2080_CTRL_CMD_FB_GET_INFO:
-      ret = post_rm_control_fb_get_info(pApi->hObject, pApi->params,
-                                        pApi->paramsSize);
-      break;
-      /* 0x20801303 */
-    case NV2080_CTRL_CMD_FB_GET_INFO_V2:
-      ret = post_rm_control_fb_get_info_v2(pApi->hObject, pApi->params,
-                                           pApi->paramsSize);
-      break;
-    default:
-      break;
+  if (!get_fb_info_list(pApi->cmd, pApi->params, pApi->paramsSize, &list,
+                        &count)) {
+    ret = post_rm_control_fb_get_info(pApi->hClient, pApi->hObject, list,
+                                      count);
   }
 
 finish:
   return ret;
 }
 
-void free_device_page(uint32_t page) {
-  struct list_head *iter = NULL;
+/* give back a reservation whose ioctl failed or wasn't committed */
+void ioctl_rollback(ioctl_ctx_t *ctx) {
+  if (likely(!ctx->reserved)) {
+    return;
+  }
+
+  ledger_release(ctx->dev, ctx->reserved);
+  ctx->reserved = 0;
+}
+
+/* must be called with rm_mem_mu held */
+int free_device_page(uint32_t root, uint32_t page) {
+  client_arena_t *arena = NULL;
   rm_mem_t *entry = NULL;
 
-  list_for_each(iter, &gpu_device.rm_mem_list) {
-    entry = container_of(iter, rm_mem_t, node);
-    if (entry->object == page) {
-      break;
-    }
+  arena = arena_find(&rm_arenas, root);
+  if (!arena) {
+    return -ENOENT;
+  }
+
+  entry = htable_remove(&arena->objects, page);
+  if (!entry) {
+    return -ENOENT;
   }
 
-  if (likely(entry)) {
 #ifndef NDEBUG
-    LOGGER(VERBOSE, "free device page: %d", entry->device_id);
+  LOGGER(VERBOSE, "free device page: %d", entry->device_id);
 #endif
 
-    list_del(&entry->node);
+  slab_free(&rm_mem_cache, entry);
+  entry = NULL;
 
-    free(entry);
-    entry = NULL;
-  }
+  return 0;
 }
 
-void free_heap_page(uint32_t page) {
-  struct list_head *iter = NULL;
+/* must be called with dev->mu held */
+int free_heap_page(device_prop_t *dev, uint32_t root, uint32_t page) {
+  client_arena_t *arena = NULL;
   device_mem_t *entry = NULL;
+  size_t size = 0;
 
-  list_for_each(iter, &gpu_device.heap_mem_list) {
-    entry = container_of(iter, device_mem_t, node);
-    if (entry->object == page) {
-      break;
-    }
+  arena = arena_find(&dev->heap_arenas, root);
+  if (!arena) {
+    return -ENOENT;
   }
 
-  if (likely(entry)) {
-    gpu_device.fb_info->free_mem += entry->size;
-    gpu_device.alloc_mem -= entry->size;
+  entry = htable_remove(&arena->objects, page);
+  if (!entry) {
+    return -ENOENT;
+  }
+
+  size = put_heap_block(entry);
+  if (size) {
+    ledger_release(dev, size);
+    dev->alloc_mem -= size;
+    watermark_check(dev);
+  }
 
 #ifndef NDEBUG
-    LOGGER(VERBOSE, "free heap page: 0x%x, size: %lu, use: %lu", entry->object,
-           entry->size, gpu_device.alloc_mem);
+  LOGGER(VERBOSE, "free heap page: 0x%x, device: %u, size: %lu, use: %lu",
+         entry->object, dev->minor, size, dev->alloc_mem);
 #endif
 
-    list_del(&entry->node);
+  slab_free(&heap_mem_cache, entry);
+  entry = NULL;
+
+  return 0;
+}
+
+static int free_device_heap_page(device_prop_t *dev, uint32_t root,
+                                 uint32_t page) {
+  int ret = 0;
+
+  pthread_mutex_lock(&dev->mu);
+  ret = free_heap_page(dev, root, page);
+  pthread_mutex_unlock(&dev->mu);
+
+  return ret;
+}
+
+/*
+ * the driver frees every object of a client with its root, drop the client
+ * arenas and credit the blocks no other client shares in one step. Finding
+ * the handles is a single detach, releasing them still walks each one:
+ * blocks are refcounted across clients that dup'ed them, only the last
+ * reference may credit the ledger.
+ */
+static void free_client(uint32_t root) {
+  client_arena_t *arena = NULL;
+  htable_slot_t *slot = NULL;
+  device_prop_t *dev = NULL;
+  size_t size = 0;
+  int i = 0;
+
+  pthread_mutex_lock(&rm_mem_mu);
+  arena = arena_detach(&rm_arenas, root);
+  pthread_mutex_unlock(&rm_mem_mu);
 
-    free(entry);
-    entry = NULL;
+  if (arena) {
+    htable_for_each(slot, &arena->objects) {
+      if (slot->value) {
+        slab_free(&rm_mem_cache, slot->value);
+      }
+    }
+    arena_free(arena);
+  }
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    dev = &gpu_devices[i];
+    if (!dev->mem_limited) {
+      continue;
+    }
+
+    pthread_mutex_lock(&dev->mu);
+    arena = arena_detach(&dev->heap_arenas, root);
+    if (!arena) {
+      pthread_mutex_unlock(&dev->mu);
+      continue;
+    }
+
+    size = 0;
+    htable_for_each(slot, &arena->objects) {
+      if (slot->value) {
+        size += put_heap_block(slot->value);
+        slab_free(&heap_mem_cache, slot->value);
+      }
+    }
+
+    if (size) {
+      ledger_release(dev, size);
+      dev->alloc_mem -= size;
+      watermark_check(dev);
+    }
+    pthread_mutex_unlock(&dev->mu);
+
+#ifndef NDEBUG
+    LOGGER(VERBOSE, "free client 0x%x, device: %u, handles: %lu, size: %lu",
+           root, dev->minor, htable_size(&arena->objects), size);
+#endif
+
+    arena_free(arena);
   }
 }
 
-int post_rm_free(uint32_t minor, size_t arg_size, void *arg) {
+int post_rm_free(ioctl_ctx_t *ctx, size_t arg_size, void *arg) {
   int ret = 0;
   NVOS00_PARAMETERS *pApi = arg;
+  device_prop_t *dev = NULL;
+  int i = 0;
 
-  if (unlikely(minor != NVIDIA_CTL_MINOR)) {
+  if (unlikely(ctx->minor != NVIDIA_CTL_MINOR)) {
     ret = -EINVAL;
     goto finish;
   }
@@ -607,129 +1079,193 @@ int post_rm_free(uint32_t minor, size_t arg_size, void *arg) {
 #endif
 
   if (unlikely(pApi->hObjectOld == pApi->hRoot)) {
+    free_client(pApi->hRoot);
     goto finish;
   }
 
-  pthread_mutex_lock(&gpu_device.mu);
+  /* device and subdevice handles live in the rm table, memory in the heap */
+  pthread_mutex_lock(&rm_mem_mu);
+  ret = free_device_page(pApi->hRoot, pApi->hObjectOld);
+  pthread_mutex_unlock(&rm_mem_mu);
+  if (ret != -ENOENT) {
+    goto finish;
+  }
+  ret = 0;
 
-  if (pApi->hRoot == pApi->hObjectParent) {
-    free_device_page(pApi->hObjectOld);
-  } else {
-    free_heap_page(pApi->hObjectOld);
+  dev = find_device(pApi->hRoot, pApi->hObjectParent);
+  if (dev && !free_device_heap_page(dev, pApi->hRoot, pApi->hObjectOld)) {
+    goto finish;
+  }
+
+  /* the parent was freed first or is unknown, look on every device */
+  for (i = 0; i < MAX_DEVICE_COUNT && mem_limited_count > 1; i++) {
+    if (gpu_devices[i].mem_limited && &gpu_devices[i] != dev &&
+        !free_device_heap_page(&gpu_devices[i], pApi->hRoot,
+                               pApi->hObjectOld)) {
+      break;
+    }
   }
 
-  pthread_mutex_unlock(&gpu_device.mu);
 finish:
   return ret;
 }
 
-int post_ioctl(uint32_t major, uint32_t minor, uint32_t cmd, void *arg) {
+/*
+ * a duplicated handle refers to the object of its source. Device handles
+ * keep resolving to their device, memory handles share the block of the
+ * source so it is credited once, when the last of them is freed. Sources
+ * owned by other processes, like CUDA IPC imports, were charged by their
+ * owner and stay untracked here.
+ */
+int post_rm_dup_object(ioctl_ctx_t *ctx, size_t arg_size, void *arg) {
   int ret = 0;
-  int arg_cmd = 0;
-  size_t arg_size = 0;
+  NVOS55_PARAMETERS *pApi = arg;
+  rm_mem_t *rm_entry = NULL;
+  device_mem_t *entry = NULL;
+  device_prop_t *dev = NULL;
+  int device_id = -1;
+  int i = 0;
 
-  if (unlikely(major != NVIDIA_DEVICE_MAJOR)) {
+  if (unlikely(ctx->minor != NVIDIA_CTL_MINOR)) {
+    ret = -EINVAL;
     goto finish;
   }
 
-  arg_size = _IOC_SIZE(cmd);
-  arg_cmd = _IOC_NR(cmd);
+  if (unlikely(pApi->status != NV_OK)) {
+    goto finish;
+  }
 
-  switch (arg_cmd) {
-      /* 0x4a */
-    case NV_ESC_RM_VID_HEAP_CONTROL:
-      ret = post_rm_vid_heap_control(minor, arg_size, arg);
-      break;
-      /* 0x2a */
-    case NV_ESC_RM_CONTROL:
-      ret = post_rm_control(minor, arg_size, arg);
-      break;
-      /* 0x29 */
-    case NV_ESC_RM_FREE:
-      ret = post_rm_free(minor, arg_size, arg);
-      break;
-    case NV_ESC_RM_ALLOC:
-      ret = post_rm_alloc(minor, arg_size, arg);
-      break;
-    default:
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "rm dup 0x%x:0x%x from 0x%x:0x%x", pApi->hClient,
+         pApi->hObject, pApi->hClientSrc, pApi->hObjectSrc);
+#endif
+
+  pthread_mutex_lock(&rm_mem_mu);
+  rm_entry = arena_find_object(&rm_arenas, pApi->hClientSrc, pApi->hObjectSrc);
+  if (rm_entry) {
+    device_id = rm_entry->device_id;
+    ret = track_device_handle(pApi->hClient, pApi->hObject, device_id);
+  }
+  pthread_mutex_unlock(&rm_mem_mu);
+  if (device_id >= 0) {
+    goto finish;
+  }
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    dev = &gpu_devices[i];
+    if (!dev->mem_limited) {
+      continue;
+    }
+
+    pthread_mutex_lock(&dev->mu);
+    entry = arena_find_object(&dev->heap_arenas, pApi->hClientSrc,
+                              pApi->hObjectSrc);
+    if (entry) {
+      ret = insert_heap_handle(dev, pApi->hClient, pApi->hObject,
+                               entry->block);
+    }
+    pthread_mutex_unlock(&dev->mu);
+
+    if (entry) {
       break;
+    }
   }
 
 finish:
   return ret;
 }
 
-void _init_device_prop() {
-  int ret = 0;
-  token_attr_t *attr = NULL;
+/* the RM escapes of /dev/nvidiactl and /dev/nvidia<N> we account */
+static void register_rm_handlers(void) {
+  uint32_t classes = IOCTL_CLASS(FD_CLASS_NVIDIA_CTL) |
+                     IOCTL_CLASS(FD_CLASS_NVIDIA_DEVICE);
+
+  /* 0x4a */
+  register_ioctl_handler(NV_ESC_RM_VID_HEAP_CONTROL, classes,
+                         pre_vid_heap_alloc, post_rm_vid_heap_control);
+  /* 0x2a */
+  register_ioctl_handler(NV_ESC_RM_CONTROL, classes, pre_rm_control,
+                         post_rm_control);
+  /* 0x29 */
+  register_ioctl_handler(NV_ESC_RM_FREE, classes, NULL, post_rm_free);
+  /* 0x2b */
+  register_ioctl_handler(NV_ESC_RM_ALLOC, classes, pre_rm_alloc,
+                         post_rm_alloc);
+  /* 0x34 */
+  register_ioctl_handler(NV_ESC_RM_DUP_OBJECT, classes, NULL,
+                         post_rm_dup_object);
+}
+
+static void init_device_mem(device_prop_t *dev, size_t total_mem,
+                            size_t lease_size) {
   fb_info_t *fb_info = NULL;
-  size_t core_limit;
-  size_t total_mem;
-  pid_t pid = 0;
-  char cgroup_id[PATH_MAX] = {0};
+  pid_t pid = getpid();
   char path[PATH_MAX] = {0};
   struct stat buf;
   int need_init = 0;
-  share_data_t fb_share_data, attr_share_data;
-
-  ret = get_mem_limit(&gpu_device.minor, &total_mem);
-  if (unlikely(ret)) {
-    LOGGER(VERBOSE, "get mem limit failed");
-    return;
-  }
-  gpu_device.mem_limited = 1;
+  int ret = 0;
+  share_data_t fb_share_data;
 
   /* for memory limit */
-  sprintf(path, HOOK_SHM_FB_MEM_PATH_PATTERN, gpu_device.minor);
+  sprintf(path, HOOK_SHM_FB_MEM_PATH_PATTERN, dev->minor);
   fb_info = create_shm_addr(path, sizeof(fb_info_t), &fb_share_data);
   if (unlikely(!fb_info)) {
     LOGGER(ERROR, "create fb shm addr failed");
     exit(-1);
     return;
   }
-  gpu_device.fb_info = fb_info;
-  pid = getpid();
+  dev->fb_info = fb_info;
+
+  /* give back whatever killed processes left charged */
+  charge_scavenge(fb_info, 1);
 
   need_init = fb_info->pid == 0 ? 1 : 0;
   if (!need_init) {
-    /* if fb_info->pid not existed, initialize fb info */
+    /* if fb_info->pid not existed, take over fb info */
     sprintf(path, "/proc/%d/exe", fb_info->pid);
     ret = lstat(path, &buf);
-    if (ret < 0) {
-      need_init = errno == ENOENT ? 1 : 0;
+    if (ret < 0 && errno == ENOENT) {
+      /* nobody holds budget anymore, start over with the current limit */
+      need_init = charge_live_count(fb_info) == 0 ? 1 : 0;
+      fb_info->pid = pid;
     }
   }
 
   if (need_init) {
     LOGGER(VERBOSE, "init fb info for %lu, device_id: %d, total: %x", pid,
-           gpu_device.minor, total_mem);
+           dev->minor, total_mem);
 
-    gpu_device.fb_info->total_mem = total_mem;
-    gpu_device.fb_info->free_mem = total_mem;
-    gpu_device.fb_info->pid = pid;
+    fb_info->total_mem = total_mem;
+    atomic_store(&fb_info->free_mem, total_mem);
+    fb_info->pid = pid;
   }
 
-  INIT_LIST_HEAD(&gpu_device.rm_mem_list);
-  INIT_LIST_HEAD(&gpu_device.heap_mem_list);
+  dev->charge = charge_attach(fb_info);
 
-  ret = get_core_limit(NULL, &core_limit);
-  if (likely(!ret)) {
-    gpu_device.core_limited = 1;
+  if (lease_size) {
+    ledger_lease_init(dev, lease_size);
   }
 
-  if (unlikely(!gpu_device.core_limited)) {
-    return;
-  }
-
-  /* for time limit */
-  ret = get_cgroup_id(pid, cgroup_id, sizeof(cgroup_id));
-  if (unlikely(ret < 0)) {
-    LOGGER(ERROR, "get cgroup id failed");
+  ret = htable_init(&dev->heap_arenas, HTABLE_MIN_CAPACITY);
+  if (unlikely(ret)) {
+    LOGGER(ERROR, "init heap mem table failed");
     exit(-1);
     return;
   }
 
-  sprintf(path, HOOK_SHM_PATH_PATTERN, gpu_device.minor, cgroup_id);
+  dev->mem_limited = 1;
+  mem_limited_count++;
+}
+
+static void init_device_core(device_prop_t *dev, const char *cgroup_id,
+                             size_t provisional) {
+  token_attr_t *attr = NULL;
+  char path[PATH_MAX] = {0};
+  int ret = 0;
+  share_data_t attr_share_data;
+
+  /* for time limit */
+  sprintf(path, HOOK_SHM_PATH_PATTERN, dev->minor, cgroup_id);
   attr = create_shm_addr(path, sizeof(token_attr_t), &attr_share_data);
   if (unlikely(!attr)) {
     LOGGER(ERROR, "create shm addr failed");
@@ -744,27 +1280,181 @@ void _init_device_prop() {
     return;
   }
 
-  if (likely(!attr->inited)) {
-    while ((ret = sem_wait(&attr->ready)) == -1 && errno == EINTR) {
+  /* never wait for server_monitor here, token_post takes over later */
+  ret = sem_init(&dev->tokens, 0,
+                 atomic_load(&attr->inited) ? attr->params.core_limit
+                                            : provisional);
+  if (unlikely(ret < 0)) {
+    LOGGER(ERROR, "token init failed");
+    exit(-1);
+    return;
+  }
+
+  dev->attr = attr;
+  dev->core_limited = 1;
+  core_limited_count++;
+  pthread_create(&dev->tid, NULL, token_post, dev);
+}
+
+/* publish the usage of every limited device in the node summary */
+static void init_node_summary(const char *path) {
+  node_summary_t *summary = NULL;
+  char cgroup_id[PATH_MAX] = {0};
+  device_prop_t *dev = NULL;
+  int i = 0;
+
+  if (unlikely(get_cgroup_id(getpid(), cgroup_id, sizeof(cgroup_id)) < 0)) {
+    LOGGER(WARN, "get cgroup id failed, node summary disabled");
+    return;
+  }
+
+  summary = node_summary_map(path);
+  if (unlikely(!summary)) {
+    return;
+  }
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    dev = &gpu_devices[i];
+    if (!dev->mem_limited) {
+      continue;
+    }
+
+    dev->node_ref = node_slot_attach(summary, cgroup_id, dev->minor);
+    if (dev->node_ref) {
+      node_slot_update(dev->node_ref, dev->fb_info);
+    }
+  }
+}
+
+/* record the usage history of every limited device */
+static void init_mem_history(size_t window_ms) {
+  device_prop_t *dev = NULL;
+  int i = 0;
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    dev = &gpu_devices[i];
+    if (!dev->mem_limited) {
       continue;
     }
 
-    if (ret == -1) {
-      LOGGER(ERROR, "sem_wait errno:%d, %s", errno, strerror(errno));
-      exit(-1);
-      return;
+    dev->hist = hist_map(dev->minor, window_ms);
+    if (dev->hist) {
+      hist_record(dev->hist, dev->fb_info);
+    }
+  }
+}
+
+void _init_device_prop() {
+  int ret = 0;
+  size_t mem_limits[MAX_DEVICE_COUNT] = {0};
+  size_t core_limits[MAX_DEVICE_COUNT] = {0};
+  size_t lease_size = 0;
+  size_t wait_ms = 0;
+  size_t window_ms = 0;
+  size_t prof_rate = 0;
+  size_t provisional = CORE_PROVISIONAL_TOKENS;
+  char cgroup_id[PATH_MAX] = {0};
+  char node_path[PATH_MAX] = {0};
+  char prof_prefix[PATH_MAX] = {0};
+  int i = 0;
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    gpu_devices[i].minor = i;
+  }
+
+  ret = get_mem_limits(mem_limits, MAX_DEVICE_COUNT);
+  if (unlikely(ret)) {
+    LOGGER(VERBOSE, "get mem limit failed");
+    return;
+  }
+
+  ret = htable_init(&rm_arenas, HTABLE_MIN_CAPACITY);
+  if (unlikely(ret)) {
+    LOGGER(ERROR, "init rm mem table failed");
+    exit(-1);
+    return;
+  }
+
+  if (get_mem_lease(&lease_size)) {
+    lease_size = 0;
+  }
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    if (mem_limits[i]) {
+      init_device_mem(&gpu_devices[i], mem_limits[i], lease_size);
+      mem_default_device = &gpu_devices[i];
     }
   }
 
-  ret = sem_init(&gpu_device.tokens, 0, attr->params.core_limit);
+  if (mem_limited_count != 1) {
+    mem_default_device = NULL;
+  }
+
+  if (lease_size) {
+    atexit(drain_lease);
+  }
+
+  if (mem_limited_count) {
+    register_rm_handlers();
+    uvm_register_handlers();
+    atexit(report_tracking_mem_usage);
+  }
+
+  if (!get_mem_wait(&wait_ms)) {
+    ledger_wait_init(wait_ms);
+  }
+
+  if (mem_limited_count && !get_node_summary(node_path, sizeof(node_path))) {
+    init_node_summary(node_path);
+  }
+
+  if (mem_limited_count && !get_mem_history(&window_ms)) {
+    init_mem_history(window_ms);
+  }
+
+  if (mem_limited_count &&
+      !get_mem_profile(prof_prefix, sizeof(prof_prefix), &prof_rate)) {
+    prof_init(prof_prefix, prof_rate);
+  }
+
+  ret = get_core_limits(core_limits, MAX_DEVICE_COUNT);
+  if (ret) {
+    return;
+  }
+
+  ret = get_cgroup_id(getpid(), cgroup_id, sizeof(cgroup_id));
   if (unlikely(ret < 0)) {
-    LOGGER(ERROR, "token init failed");
+    LOGGER(ERROR, "get cgroup id failed");
     exit(-1);
     return;
   }
 
-  gpu_device.attr = attr;
-  pthread_create(&gpu_device.tid, NULL, token_post, &gpu_device);
+  get_core_provisional(&provisional);
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    if (core_limits[i]) {
+      init_device_core(&gpu_devices[i], cgroup_id, provisional);
+      core_default_device = &gpu_devices[i];
+    }
+  }
+
+  if (core_limited_count != 1) {
+    core_default_device = NULL;
+  }
+}
+
+/*
+ * device state is set up lazily on cuInit or the first ioctl on an nvidia
+ * fd, processes that never touch the GPU map no shm and start no thread
+ */
+void init_device_prop() {
+  if (likely(atomic_load_explicit(&device_ready, memory_order_acquire))) {
+    return;
+  }
+
+  pthread_once(&device_once, _init_device_prop);
+  atomic_store_explicit(&device_ready, 1, memory_order_release);
 }
 
-void init_device_prop() { pthread_once(&gpu_device.once, _init_device_prop); }
+int device_prop_ready(void) {
+  return atomic_load_explicit(&device_ready, memory_order_acquire);
+}
@@ -0,0 +1,391 @@
+#include <errno.h>
+#include <time.h>
+
+#include "extern.h"
+#include "hook.h"
+
+/*
+ * Shared GPU memory ledger.
+ *
+ * fb_info->free_mem lives in the per-device shm segment and is shared by
+ * every hooked process in the container. Allocations reserve their bytes
+ * with a CAS before the ioctl reaches the driver and either keep them
+ * (commit) or give them back (rollback) once the result is known, so the
+ * limit holds exactly without a cross-process lock.
+ *
+ * With CUDA_MEM_LEASE set, a process takes budget from the shared ledger in
+ * chunks and serves allocations from its local lease, so the shared
+ * cacheline is only touched on refill and when surplus lease is returned.
+ * Unused lease is counted in fb_info->leased, published usage leaves it
+ * out. A failed reservation bumps fb_info->drain_seq, every lease drains
+ * on its next reserve or release after seeing it.
+ *
+ * With CUDA_MEM_WAIT_MS set, a reservation that doesn't fit sleeps on
+ * fb_info->free_seq until memory is given back in any process or the
+ * deadline passes.
+ */
+
+/* a process never keeps more than this share of the device as lease */
+#define LEASE_MAX_SHARE 16
+#define LEASE_WINDOW_NSEC (1000UL * 1000UL * 1000UL)
+/* refills per window above which the chunk grows */
+#define LEASE_GROW_REFILLS 4
+/* waiters recheck their own lease at least this often */
+#define WAIT_SLICE_NSEC (10UL * 1000UL * 1000UL)
+
+static uint64_t wait_nsec = 0;
+
+static int __shared_reserve(fb_info_t *fb_info, size_t size) {
+  size_t cur = atomic_load_explicit(&fb_info->free_mem, memory_order_relaxed);
+
+  do {
+    if (unlikely(cur < size)) {
+      return -ENOMEM;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(
+      &fb_info->free_mem, &cur, cur - size, memory_order_acq_rel,
+      memory_order_relaxed));
+
+  return 0;
+}
+
+/* report a change of the shared ledger to its observers */
+static void shared_publish(device_prop_t *dev) {
+  if (dev->node_ref) {
+    node_slot_update(dev->node_ref, dev->fb_info);
+  }
+  if (dev->hist) {
+    hist_record(dev->hist, dev->fb_info);
+  }
+}
+
+/* bytes taken from the shared ledger are charged to our slot, see charge.c */
+static int shared_reserve(device_prop_t *dev, size_t size) {
+  if (unlikely(__shared_reserve(dev->fb_info, size))) {
+    /* budget of killed processes may still be charged */
+    if (!charge_scavenge(dev->fb_info, 0) ||
+        __shared_reserve(dev->fb_info, size)) {
+      return -ENOMEM;
+    }
+  }
+
+  if (likely(dev->charge)) {
+    atomic_fetch_add_explicit(&dev->charge->charged, size,
+                              memory_order_relaxed);
+  }
+
+  shared_publish(dev);
+
+  return 0;
+}
+
+static void shared_release(device_prop_t *dev, size_t size) {
+  if (likely(dev->charge)) {
+    atomic_fetch_sub_explicit(&dev->charge->charged, size,
+                              memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&dev->fb_info->free_mem, size,
+                            memory_order_release);
+  fb_info_notify(dev->fb_info);
+
+  shared_publish(dev);
+}
+
+static uint64_t lease_clock(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000UL * 1000UL * 1000UL + now.tv_nsec;
+}
+
+/* delta bytes moved into the lease of dev, out of it if negative */
+static void lease_account(device_prop_t *dev, long delta) {
+  atomic_fetch_add_explicit(&dev->fb_info->leased, delta,
+                            memory_order_relaxed);
+  if (likely(dev->charge)) {
+    atomic_fetch_add_explicit(&dev->charge->leased, delta,
+                              memory_order_relaxed);
+  }
+}
+
+/* someone waits, or a reservation failed since we last looked */
+static int lease_pressure(device_prop_t *dev) {
+  fb_info_t *fb_info = dev->fb_info;
+  uint32_t seq = 0;
+
+  if (unlikely(atomic_load_explicit(&fb_info->waiters,
+                                    memory_order_relaxed) > 0)) {
+    return 1;
+  }
+
+  seq = atomic_load_explicit(&fb_info->drain_seq, memory_order_relaxed);
+  if (likely(seq == atomic_load_explicit(&dev->lease.drain_seen,
+                                         memory_order_relaxed))) {
+    return 0;
+  }
+
+  atomic_store_explicit(&dev->lease.drain_seen, seq, memory_order_relaxed);
+  return 1;
+}
+
+static int lease_take(mem_lease_t *lease, size_t size) {
+  size_t cur = atomic_load_explicit(&lease->avail, memory_order_relaxed);
+
+  do {
+    if (cur < size) {
+      return -ENOMEM;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(
+      &lease->avail, &cur, cur - size, memory_order_relaxed,
+      memory_order_relaxed));
+
+  return 0;
+}
+
+/* grow the chunk for processes that refill often, shrink it for idle ones */
+static size_t lease_adapt(mem_lease_t *lease) {
+  uint64_t now = lease_clock();
+  uint64_t start = atomic_load(&lease->window_start);
+  size_t chunk = atomic_load(&lease->chunk);
+  int refills = atomic_fetch_add(&lease->refills, 1) + 1;
+
+  if (now - start < LEASE_WINDOW_NSEC) {
+    if (refills > LEASE_GROW_REFILLS && chunk < lease->max_chunk) {
+      chunk = MIN(chunk << 1, lease->max_chunk);
+      atomic_store(&lease->chunk, chunk);
+      atomic_store(&lease->refills, 0);
+    }
+    return chunk;
+  }
+
+  if (atomic_compare_exchange_strong(&lease->window_start, &start, now)) {
+    if (refills <= 1 && chunk > lease->min_chunk) {
+      chunk = MAX(chunk >> 1, lease->min_chunk);
+      atomic_store(&lease->chunk, chunk);
+    }
+    atomic_store(&lease->refills, 0);
+  }
+
+  return chunk;
+}
+
+static int lease_reserve(device_prop_t *dev, size_t size) {
+  mem_lease_t *lease = &dev->lease;
+  size_t chunk = 0;
+
+  if (likely(!lease_take(lease, size))) {
+    lease_account(dev, -(long)size);
+    /* don't sit on the rest while others run short */
+    if (unlikely(lease_pressure(dev))) {
+      ledger_lease_drain(dev);
+    } else {
+      shared_publish(dev);
+    }
+    return 0;
+  }
+
+  chunk = lease_adapt(lease);
+  if (likely(size < chunk)) {
+    /* counted first, so that the publish of the refill leaves it out */
+    lease_account(dev, chunk - size);
+    if (likely(!shared_reserve(dev, chunk))) {
+      atomic_fetch_add_explicit(&lease->avail, chunk - size,
+                                memory_order_relaxed);
+      return 0;
+    }
+    lease_account(dev, -(long)(chunk - size));
+  }
+
+  /* the device is nearly full, fall back to exact reservations */
+  if (likely(!shared_reserve(dev, size))) {
+    return 0;
+  }
+
+  /* the local remainder may still make up the difference */
+  ledger_lease_drain(dev);
+  return shared_reserve(dev, size);
+}
+
+static void lease_release(device_prop_t *dev, size_t size) {
+  mem_lease_t *lease = &dev->lease;
+  size_t chunk = atomic_load_explicit(&lease->chunk, memory_order_relaxed);
+  size_t cur = 0, keep = 0;
+
+  cur = atomic_fetch_add_explicit(&lease->avail, size, memory_order_relaxed) +
+        size;
+  lease_account(dev, size);
+
+  /* another process runs short, don't sit on an idle lease */
+  if (unlikely(lease_pressure(dev))) {
+    ledger_lease_drain(dev);
+    return;
+  }
+
+  if (likely(cur <= chunk << 1)) {
+    shared_publish(dev);
+    return;
+  }
+
+  /* past two chunks, hand everything above one back to the others */
+  do {
+    if (cur <= chunk) {
+      shared_publish(dev);
+      return;
+    }
+    keep = chunk;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &lease->avail, &cur, keep, memory_order_relaxed, memory_order_relaxed));
+
+  lease_account(dev, -(long)(cur - keep));
+  shared_release(dev, cur - keep);
+}
+
+void ledger_lease_init(device_prop_t *dev, size_t chunk) {
+  mem_lease_t *lease = &dev->lease;
+  size_t max_chunk = dev->fb_info->total_mem / LEASE_MAX_SHARE;
+
+  if (unlikely(!chunk || !max_chunk)) {
+    return;
+  }
+
+  lease->min_chunk = MIN(MAX(chunk >> 4, 1UL << 20), max_chunk);
+  lease->max_chunk = MIN(chunk << 2, max_chunk);
+  atomic_store(&lease->chunk, MIN(chunk, lease->max_chunk));
+  atomic_store(&lease->avail, 0);
+  atomic_store(&lease->window_start, lease_clock());
+  atomic_store(&lease->refills, 0);
+  atomic_store(&lease->drain_seen, atomic_load(&dev->fb_info->drain_seq));
+  lease->enabled = 1;
+
+  LOGGER(VERBOSE, "memory lease chunk %lu, range [%lu, %lu]",
+         atomic_load(&lease->chunk), lease->min_chunk, lease->max_chunk);
+}
+
+/* return the whole unused lease to the shared ledger */
+void ledger_lease_drain(device_prop_t *dev) {
+  size_t avail = 0;
+
+  if (!dev->lease.enabled) {
+    return;
+  }
+
+  avail = atomic_exchange(&dev->lease.avail, 0);
+  if (avail) {
+    lease_account(dev, -(long)avail);
+    shared_release(dev, avail);
+  }
+}
+
+/* free memory as seen by this process, including its unused lease */
+size_t ledger_free_mem(device_prop_t *dev) {
+  size_t free_mem =
+      atomic_load_explicit(&dev->fb_info->free_mem, memory_order_relaxed);
+
+  if (dev->lease.enabled) {
+    free_mem += atomic_load_explicit(&dev->lease.avail, memory_order_relaxed);
+  }
+
+  return free_mem;
+}
+
+static int __ledger_reserve(device_prop_t *dev, size_t size) {
+  int ret = 0;
+
+  if (dev->lease.enabled) {
+    ret = lease_reserve(dev, size);
+  } else {
+    ret = shared_reserve(dev, size);
+  }
+
+  /* the leases of other processes may hold what is missing */
+  if (unlikely(ret)) {
+    atomic_fetch_add_explicit(&dev->fb_info->drain_seq, 1,
+                              memory_order_relaxed);
+  }
+
+  return ret;
+}
+
+/* retry whenever free_mem grows until the reservation fits or time is up */
+static int ledger_reserve_wait(device_prop_t *dev, size_t size) {
+  fb_info_t *fb_info = dev->fb_info;
+  uint64_t start = lease_clock(), now = start, left = 0;
+  struct timespec timeout;
+  uint32_t seq = 0;
+  int ret = -ENOMEM;
+
+  atomic_fetch_add(&fb_info->waiters, 1);
+  while (1) {
+    /* read the sequence first, a free after the retry fails wakes us */
+    seq = atomic_load_explicit(&fb_info->free_seq, memory_order_acquire);
+    ret = __ledger_reserve(dev, size);
+    if (!ret) {
+      break;
+    }
+
+    now = lease_clock();
+    if (now - start >= wait_nsec) {
+      break;
+    }
+
+    left = MIN(wait_nsec - (now - start), WAIT_SLICE_NSEC);
+    timeout.tv_sec = left / (1000UL * 1000UL * 1000UL);
+    timeout.tv_nsec = left % (1000UL * 1000UL * 1000UL);
+    futex_wait(&fb_info->free_seq, seq, &timeout);
+  }
+  atomic_fetch_sub(&fb_info->waiters, 1);
+
+  wait_stats_account(&fb_info->wait_stats, lease_clock() - start, ret != 0);
+
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "waited %lu ns for %lu bytes, ret: %d",
+         lease_clock() - start, size, ret);
+#endif
+
+  return ret;
+}
+
+void ledger_wait_init(size_t wait_ms) {
+  wait_nsec = wait_ms * 1000UL * 1000UL;
+  LOGGER(VERBOSE, "allocations wait up to %lu ms for memory", wait_ms);
+}
+
+/*
+ * whether an allocation of size may succeed, checked before the driver
+ * does any work for it. The reservation itself still happens on the ioctl.
+ */
+int ledger_admit(device_prop_t *dev, size_t size) {
+  if (likely(ledger_free_mem(dev) >= size)) {
+    return 1;
+  }
+
+  /* a waiting allocation may still get the memory */
+  if (wait_nsec) {
+    return 1;
+  }
+
+  return charge_scavenge(dev->fb_info, 0) && ledger_free_mem(dev) >= size;
+}
+
+int ledger_reserve(device_prop_t *dev, size_t size) {
+  int ret = __ledger_reserve(dev, size);
+
+  if (likely(!ret) || !wait_nsec) {
+    return ret;
+  }
+
+  return ledger_reserve_wait(dev, size);
+}
+
+void ledger_release(device_prop_t *dev, size_t size) {
+  if (unlikely(!size)) {
+    return;
+  }
+
+  if (dev->lease.enabled) {
+    lease_release(dev, size);
+    return;
+  }
+
+  shared_release(dev, size);
+}
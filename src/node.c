@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "hook.h"
+
+/*
+ * Node summary.
+ *
+ * The fb_info segments live in the shm of their container, a node agent
+ * can't see them. With CUDA_NODE_SUMMARY pointing at a file shared by
+ * every container of the node (a hostPath mount), hooked processes and
+ * monitors publish the memory committed per (cgroup, device) there, so a
+ * scheduler can read real usage without entering the containers.
+ *
+ * Slots are claimed with a CAS on the hash of cgroup and device and
+ * probed linearly, every update is a plain store of the ledger usage plus
+ * a CAS for the peak. Stores of concurrent updaters may land out of order,
+ * the monitor refreshes its slots periodically to settle them.
+ *
+ * Nothing releases a slot, containers just go away. updated_at is the
+ * liveness stamp: once the table is full, a claim takes over a slot that
+ * nobody updated for NODE_SLOT_STALE_NS. An idle owner notices on its next
+ * update that the key changed and claims a slot again.
+ */
+
+#define NODE_SLOT_STALE_NS (10UL * 60 * 1000 * 1000 * 1000)
+
+static uint64_t node_key(const char *cgroup_id, uint32_t device) {
+  /* FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const char *p = NULL;
+
+  for (p = cgroup_id; *p; p++) {
+    hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+  }
+  hash = (hash ^ device) * 0x100000001b3ULL;
+
+  return hash ? hash : 1;
+}
+
+node_summary_t *node_summary_map(const char *path) {
+  node_summary_t *summary = NULL;
+  struct stat buf;
+  int fd = -1;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (unlikely(fd < 0)) {
+    LOGGER(WARN, "open node summary %s failed %d", path, errno);
+    goto done;
+  }
+
+  /* containers may run as different users, ignore failures of non owners */
+  fchmod(fd, 0666);
+
+  /* whoever comes first sizes the file, zero filled */
+  if (unlikely(fstat(fd, &buf) < 0)) {
+    goto done;
+  }
+  if (buf.st_size < (off_t)sizeof(node_summary_t) &&
+      ftruncate(fd, sizeof(node_summary_t)) < 0) {
+    LOGGER(WARN, "size node summary %s failed %d", path, errno);
+    goto done;
+  }
+
+  summary = mmap(NULL, sizeof(node_summary_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  if (unlikely(summary == MAP_FAILED)) {
+    LOGGER(WARN, "map node summary %s failed %d", path, errno);
+    summary = NULL;
+    goto done;
+  }
+
+  /* every writer stores the same header, no need to order them */
+  summary->slot_count = NODE_MAX_SLOTS;
+  summary->slot_size = sizeof(node_slot_t);
+  summary->version = NODE_SUMMARY_VERSION;
+  summary->magic = NODE_SUMMARY_MAGIC;
+
+done:
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  return summary;
+}
+
+static uint64_t node_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  return now.tv_sec * 1000UL * 1000UL * 1000UL + now.tv_nsec;
+}
+
+/* slots still being claimed are never stale */
+static int node_slot_stale(node_slot_t *slot, uint64_t now) {
+  uint64_t updated_at =
+      atomic_load_explicit(&slot->updated_at, memory_order_acquire);
+
+  return atomic_load_explicit(&slot->ready, memory_order_acquire) &&
+         now > updated_at + NODE_SLOT_STALE_NS;
+}
+
+/* fill a slot whose key we just set */
+static void node_slot_init(node_slot_t *slot, const char *cgroup_id,
+                           uint32_t device, uint64_t now) {
+  atomic_store_explicit(&slot->ready, 0, memory_order_release);
+  slot->device = device;
+  memset(slot->cgroup, 0, sizeof(slot->cgroup));
+  strncpy(slot->cgroup, cgroup_id, sizeof(slot->cgroup) - 1);
+  atomic_store_explicit(&slot->limit, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->committed, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->peak, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->updated_at, now, memory_order_relaxed);
+  atomic_store_explicit(&slot->ready, 1, memory_order_release);
+}
+
+static node_slot_t *node_slot_claim(node_summary_t *summary, uint64_t key,
+                                    const char *cgroup_id, uint32_t device) {
+  uint64_t now = node_now();
+  uint64_t cur = 0;
+  node_slot_t *slot = NULL, *stale = NULL;
+  int i = 0;
+
+  for (i = 0; i < NODE_MAX_SLOTS; i++) {
+    slot = &summary->slots[(key + i) % NODE_MAX_SLOTS];
+    cur = atomic_load_explicit(&slot->key, memory_order_acquire);
+    if (cur == key) {
+      return slot;
+    }
+    if (cur) {
+      if (!stale && node_slot_stale(slot, now)) {
+        stale = slot;
+      }
+      continue;
+    }
+
+    if (atomic_compare_exchange_strong(&slot->key, &cur, key)) {
+      node_slot_init(slot, cgroup_id, device, now);
+      return slot;
+    }
+    /* lost the race, maybe to our own cgroup */
+    if (cur == key) {
+      return slot;
+    }
+  }
+
+  /* full, the first stale slot of our probe sequence is taken over */
+  if (stale) {
+    cur = atomic_load_explicit(&stale->key, memory_order_acquire);
+    if (node_slot_stale(stale, now) &&
+        atomic_compare_exchange_strong(&stale->key, &cur, key)) {
+      LOGGER(VERBOSE, "take over stale node slot of cgroup %s device %u",
+             stale->cgroup, stale->device);
+      node_slot_init(stale, cgroup_id, device, now);
+      return stale;
+    }
+  }
+
+  return NULL;
+}
+
+/* find or claim the slot of cgroup_id on device */
+node_ref_t *node_slot_attach(node_summary_t *summary, const char *cgroup_id,
+                             uint32_t device) {
+  node_ref_t *ref = NULL;
+  node_slot_t *slot = NULL;
+  uint64_t key = node_key(cgroup_id, device);
+
+  slot = node_slot_claim(summary, key, cgroup_id, device);
+  if (unlikely(!slot)) {
+    LOGGER(WARN, "node summary full, cgroup %s device %u not published",
+           cgroup_id, device);
+    return NULL;
+  }
+
+  ref = calloc(1, sizeof(*ref));
+  if (unlikely(!ref)) {
+    return NULL;
+  }
+
+  ref->summary = summary;
+  ref->key = key;
+  ref->device = device;
+  strncpy(ref->cgroup, cgroup_id, sizeof(ref->cgroup) - 1);
+  atomic_store_explicit(&ref->slot, slot, memory_order_release);
+
+  return ref;
+}
+
+/* publish the usage of the ledger fb_info into the slot of ref */
+void node_slot_update(node_ref_t *ref, fb_info_t *fb_info) {
+  node_slot_t *slot = atomic_load_explicit(&ref->slot, memory_order_acquire);
+  size_t total_mem = fb_info->total_mem;
+  uint64_t used = fb_info_committed(fb_info);
+  uint64_t peak = 0, key = 0;
+
+  if (likely(slot)) {
+    key = atomic_load_explicit(&slot->key, memory_order_acquire);
+  }
+
+  /* taken over while we were idle, or lost to a full table before */
+  if (unlikely(key != ref->key)) {
+    slot = node_slot_claim(ref->summary, ref->key, ref->cgroup, ref->device);
+    atomic_store_explicit(&ref->slot, slot, memory_order_release);
+    if (unlikely(!slot)) {
+      return;
+    }
+  }
+
+  peak = atomic_load_explicit(&slot->peak, memory_order_relaxed);
+
+  atomic_store_explicit(&slot->limit, total_mem, memory_order_relaxed);
+  atomic_store_explicit(&slot->committed, used, memory_order_relaxed);
+  while (used > peak && !atomic_compare_exchange_weak_explicit(
+                            &slot->peak, &peak, used, memory_order_relaxed,
+                            memory_order_relaxed)) {
+    continue;
+  }
+
+  atomic_store_explicit(&slot->updated_at, node_now(), memory_order_release);
+}
@@ -0,0 +1,437 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <link.h>
+#include <math.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "hook.h"
+#include "slab.h"
+
+/*
+ * Heap profiler for device memory.
+ *
+ * With CUDA_MEM_PROFILE=<path prefix> set, charged allocations are sampled
+ * like tcmalloc samples heap allocations: a per-thread countdown of
+ * exponentially distributed bytes with mean CUDA_MEM_PROFILE_RATE picks
+ * the allocations whose call stack is recorded, so allocations much larger
+ * than the rate are always recorded. Stacks are kept per call site with
+ * their live and total bytes, and credited back when the allocation is
+ * freed.
+ *
+ * Profiles are written in the gperftools heap text format, which pprof
+ * reads and unsamples, on PROF_SIGNAL and at exit. The exit dump also
+ * reports the sites that still hold memory at teardown.
+ */
+
+#define PROF_MAX_DEPTH 32
+#define PROF_DEFAULT_RATE (2UL << 20)
+#define PROF_SIGNAL SIGUSR2
+/* sites listed in the teardown report */
+#define PROF_REPORT_SITES 16
+
+struct prof_site {
+  uint64_t hash;
+  int depth;
+  void *frames[PROF_MAX_DEPTH];
+  atomic_long live_objs;
+  atomic_long live_bytes;
+  atomic_long alloc_objs;
+  atomic_long alloc_bytes;
+};
+
+static int prof_enabled = 0;
+static size_t prof_rate = PROF_DEFAULT_RATE;
+static char prof_prefix[PATH_MAX];
+/* text of our own object, skipped at the top of recorded stacks */
+static uintptr_t prof_self_lo = 0;
+static uintptr_t prof_self_hi = 0;
+
+/* stack hash -> prof_site_t, guarded by prof_mu, sites are never freed */
+static pthread_mutex_t prof_mu = PTHREAD_MUTEX_INITIALIZER;
+static htable_t prof_sites;
+static slab_cache_t prof_site_cache = SLAB_CACHE_INIT("prof_site", prof_site_t);
+
+/* futex word kicked from the signal handler */
+static atomic_uint prof_seq;
+static atomic_int prof_dumps;
+static pthread_t prof_tid;
+
+static __thread int64_t prof_countdown = -1;
+static __thread uint64_t prof_random = 0;
+
+static int64_t prof_next_sample(void) {
+  double u = 0;
+
+  if (unlikely(!prof_random)) {
+    prof_random = ((uint64_t)pthread_self() ^ (uint64_t)time(NULL)) | 1;
+  }
+
+  /* xorshift64 */
+  prof_random ^= prof_random << 13;
+  prof_random ^= prof_random >> 7;
+  prof_random ^= prof_random << 17;
+
+  u = ((prof_random >> 11) + 1) * (1.0 / 9007199254740993.0);
+  return (int64_t)(-log(u) * prof_rate) + 1;
+}
+
+static int prof_should_sample(size_t size) {
+  if (unlikely(prof_countdown < 0)) {
+    prof_countdown = prof_next_sample();
+  }
+
+  prof_countdown -= size;
+  if (likely(prof_countdown > 0)) {
+    return 0;
+  }
+
+  prof_countdown = prof_next_sample();
+  return 1;
+}
+
+static uint64_t prof_hash(void **frames, int depth) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  int i = 0;
+
+  for (i = 0; i < depth; i++) {
+    hash = (hash ^ (uint64_t)frames[i]) * 0x100000001b3ULL;
+  }
+
+  return hash ? hash : 1;
+}
+
+/* record the calling stack, returns the site to hand to prof_free */
+prof_site_t *prof_alloc(size_t size) {
+  void *frames[PROF_MAX_DEPTH + 8];
+  prof_site_t *site = NULL;
+  uint64_t hash = 0;
+  int depth = 0, skip = 0;
+
+  if (likely(!prof_enabled) || !prof_should_sample(size)) {
+    return NULL;
+  }
+
+  depth = backtrace(frames, PROF_MAX_DEPTH + 8);
+
+  /* our own frames say nothing about the caller, dladdr would take the
+   * loader lock for each of them */
+  while (skip < depth && (uintptr_t)frames[skip] >= prof_self_lo &&
+         (uintptr_t)frames[skip] < prof_self_hi) {
+    skip++;
+  }
+  depth = MIN(depth - skip, PROF_MAX_DEPTH);
+  hash = prof_hash(frames + skip, depth);
+
+  pthread_mutex_lock(&prof_mu);
+  site = htable_find(&prof_sites, hash);
+  if (!site) {
+    site = slab_alloc(&prof_site_cache);
+    if (unlikely(!site)) {
+      goto finish;
+    }
+
+    memset(site, 0, sizeof(*site));
+    site->hash = hash;
+    site->depth = depth;
+    memcpy(site->frames, frames + skip, depth * sizeof(void *));
+    if (unlikely(htable_insert(&prof_sites, hash, site))) {
+      slab_free(&prof_site_cache, site);
+      site = NULL;
+      goto finish;
+    }
+  }
+
+finish:
+  pthread_mutex_unlock(&prof_mu);
+
+  if (likely(site)) {
+    atomic_fetch_add_explicit(&site->live_objs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->live_bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->alloc_objs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->alloc_bytes, size, memory_order_relaxed);
+  }
+
+  return site;
+}
+
+void prof_free(prof_site_t *site, size_t size) {
+  prof_adjust(site, -1, -(long)size);
+}
+
+/* an allocation of site was split or shrunk */
+void prof_adjust(prof_site_t *site, long objs, long bytes) {
+  if (likely(!site)) {
+    return;
+  }
+
+  atomic_fetch_add_explicit(&site->live_objs, objs, memory_order_relaxed);
+  atomic_fetch_add_explicit(&site->live_bytes, bytes, memory_order_relaxed);
+}
+
+/* counters of a site copied under prof_mu, frames never change */
+typedef struct {
+  prof_site_t *site;
+  long live_objs;
+  long live_bytes;
+  long alloc_objs;
+  long alloc_bytes;
+} prof_snap_t;
+
+/* copy every site so that a dump does its file I/O without prof_mu */
+static prof_snap_t *prof_snapshot(size_t *count) {
+  htable_slot_t *slot = NULL;
+  prof_site_t *site = NULL;
+  prof_snap_t *snaps = NULL;
+  size_t n = 0;
+
+  pthread_mutex_lock(&prof_mu);
+  snaps = malloc(MAX(htable_size(&prof_sites), 1UL) * sizeof(*snaps));
+  if (unlikely(!snaps)) {
+    goto finish;
+  }
+
+  htable_for_each(slot, &prof_sites) {
+    if (!(site = slot->value)) {
+      continue;
+    }
+    snaps[n].site = site;
+    snaps[n].live_objs = atomic_load(&site->live_objs);
+    snaps[n].live_bytes = atomic_load(&site->live_bytes);
+    snaps[n].alloc_objs = atomic_load(&site->alloc_objs);
+    snaps[n].alloc_bytes = atomic_load(&site->alloc_bytes);
+    n++;
+  }
+
+finish:
+  pthread_mutex_unlock(&prof_mu);
+  *count = n;
+  return snaps;
+}
+
+static void prof_write_site(FILE *fp, const prof_snap_t *snap) {
+  int i = 0;
+
+  fprintf(fp, "%6ld: %8ld [%6ld: %8ld] @", snap->live_objs, snap->live_bytes,
+          snap->alloc_objs, snap->alloc_bytes);
+  for (i = 0; i < snap->site->depth; i++) {
+    fprintf(fp, " %p", snap->site->frames[i]);
+  }
+  fprintf(fp, "\n");
+}
+
+static void prof_write_maps(FILE *fp) {
+  char buf[4096];
+  FILE *maps = NULL;
+  size_t n = 0;
+
+  maps = fopen("/proc/self/maps", "r");
+  if (unlikely(!maps)) {
+    return;
+  }
+
+  fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+  while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+    fwrite(buf, 1, n, fp);
+  }
+  fclose(maps);
+}
+
+/* write a profile in the gperftools heap format */
+static int prof_write(const char *path, const prof_snap_t *snaps,
+                      size_t count) {
+  long live_objs = 0, live_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+  FILE *fp = NULL;
+  size_t i = 0;
+
+  fp = fopen(path, "w");
+  if (unlikely(!fp)) {
+    LOGGER(WARN, "open profile %s failed %d", path, errno);
+    return -errno;
+  }
+
+  for (i = 0; i < count; i++) {
+    live_objs += snaps[i].live_objs;
+    live_bytes += snaps[i].live_bytes;
+    alloc_objs += snaps[i].alloc_objs;
+    alloc_bytes += snaps[i].alloc_bytes;
+  }
+
+  fprintf(fp, "heap profile: %6ld: %8ld [%6ld: %8ld] @ heap_v2/%lu\n",
+          live_objs, live_bytes, alloc_objs, alloc_bytes, prof_rate);
+  for (i = 0; i < count; i++) {
+    prof_write_site(fp, &snaps[i]);
+  }
+  prof_write_maps(fp);
+  fclose(fp);
+
+  LOGGER(INFO, "wrote device memory profile %s", path);
+  return 0;
+}
+
+static void prof_dump(const char *suffix) {
+  char path[PATH_MAX + 64] = {0};
+  prof_snap_t *snaps = NULL;
+  size_t count = 0;
+
+  snprintf(path, sizeof(path), "%s.%d.%s.heap", prof_prefix, getpid(),
+           suffix);
+
+  snaps = prof_snapshot(&count);
+  if (unlikely(!snaps)) {
+    LOGGER(WARN, "no memory for profile %s", path);
+    return;
+  }
+
+  prof_write(path, snaps, count);
+  free(snaps);
+}
+
+/* sites still holding memory at teardown, largest first */
+static void prof_report(void) {
+  prof_site_t *top[PROF_REPORT_SITES] = {NULL};
+  htable_slot_t *slot = NULL;
+  prof_site_t *site = NULL;
+  Dl_info info;
+  long bytes = 0;
+  int count = 0;
+  int i = 0, j = 0;
+
+  pthread_mutex_lock(&prof_mu);
+  htable_for_each(slot, &prof_sites) {
+    site = slot->value;
+    bytes = site ? atomic_load(&site->live_bytes) : 0;
+    if (bytes <= 0) {
+      continue;
+    }
+
+    for (i = count; i > 0 && atomic_load(&top[i - 1]->live_bytes) < bytes;
+         i--) {
+      continue;
+    }
+    if (i >= PROF_REPORT_SITES) {
+      continue;
+    }
+
+    for (j = MIN(count, PROF_REPORT_SITES - 1); j > i; j--) {
+      top[j] = top[j - 1];
+    }
+    top[i] = site;
+    count = MIN(count + 1, PROF_REPORT_SITES);
+  }
+  pthread_mutex_unlock(&prof_mu);
+
+  for (i = 0; i < count; i++) {
+    LOGGER(WARN, "%ld bytes in %ld allocations still tracked at exit from:",
+           atomic_load(&top[i]->live_bytes), atomic_load(&top[i]->live_objs));
+    for (j = 0; j < top[i]->depth; j++) {
+      if (dladdr(top[i]->frames[j], &info) && info.dli_sname) {
+        LOGGER(WARN, "  #%d %p %s+0x%lx (%s)", j, top[i]->frames[j],
+               info.dli_sname,
+               (char *)top[i]->frames[j] - (char *)info.dli_saddr,
+               info.dli_fname);
+      } else {
+        LOGGER(WARN, "  #%d %p (%s)", j, top[i]->frames[j],
+               info.dli_fname ? info.dli_fname : "?");
+      }
+    }
+  }
+}
+
+static void prof_exit(void) {
+  prof_dump("final");
+  prof_report();
+}
+
+static void prof_signal(int sig) {
+  atomic_fetch_add_explicit(&prof_seq, 1, memory_order_release);
+  futex_wake(&prof_seq, 1);
+}
+
+/* dumps are written here, the signal handler only kicks this thread */
+static void *prof_post(void *arg) {
+  char suffix[32] = {0};
+  uint32_t seen = 0, seq = 0;
+
+  while (1) {
+    /* signals raised before we got here are dumped too */
+    seq = atomic_load_explicit(&prof_seq, memory_order_acquire);
+    if (seq == seen) {
+      futex_wait(&prof_seq, seq, NULL);
+      continue;
+    }
+    seen = seq;
+
+    snprintf(suffix, sizeof(suffix), "%04d", atomic_fetch_add(&prof_dumps, 1));
+    prof_dump(suffix);
+  }
+
+  return NULL;
+}
+
+static int prof_self_range(struct dl_phdr_info *info, size_t size,
+                           void *data) {
+  uintptr_t self = (uintptr_t)prof_self_range;
+  uintptr_t lo = UINTPTR_MAX, hi = 0, start = 0;
+  size_t i = 0;
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    if (info->dlpi_phdr[i].p_type != PT_LOAD) {
+      continue;
+    }
+
+    start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+    lo = MIN(lo, start);
+    hi = MAX(hi, start + info->dlpi_phdr[i].p_memsz);
+  }
+
+  if (self < lo || self >= hi) {
+    return 0;
+  }
+
+  prof_self_lo = lo;
+  prof_self_hi = hi;
+  return 1;
+}
+
+void prof_init(const char *prefix, size_t rate) {
+  struct sigaction act, old;
+  void *frames[1];
+
+  if (unlikely(htable_init(&prof_sites, HTABLE_MIN_CAPACITY))) {
+    LOGGER(WARN, "init profile table failed, profiling disabled");
+    return;
+  }
+
+  strncpy(prof_prefix, prefix, sizeof(prof_prefix) - 1);
+  if (rate) {
+    prof_rate = rate;
+  }
+
+  dl_iterate_phdr(prof_self_range, NULL);
+
+  /* the first backtrace loads the unwinder, not under the ioctl path */
+  backtrace(frames, 1);
+
+  if (unlikely(pthread_create(&prof_tid, NULL, prof_post, NULL))) {
+    LOGGER(WARN, "start profile thread failed, dumping at exit only");
+  } else if (!sigaction(PROF_SIGNAL, NULL, &old) &&
+             old.sa_handler == SIG_DFL) {
+    /* leave the signal alone if the application uses it */
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = prof_signal;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    sigaction(PROF_SIGNAL, &act, NULL);
+  }
+
+  atexit(prof_exit);
+  prof_enabled = 1;
+
+  LOGGER(VERBOSE, "profile device memory to %s, sample rate %lu", prefix,
+         prof_rate);
+}
@@ -0,0 +1,80 @@
+#include <errno.h>
+
+#include "extern.h"
+#include "hook.h"
+#include "nvrc.h"
+
+/*
+ * Budget queries, see nvrc.h.
+ *
+ * Everything is read with relaxed atomics from the fb_info segment, the
+ * process lease and the token semaphore, which glibc reads without a
+ * syscall.
+ */
+
+extern device_prop_t *get_device_prop(int device_id);
+
+EXPORT_API int nvrc_mem_info(int device, nvrc_mem_info_t *info) {
+  device_prop_t *dev = NULL;
+  fb_wait_stats_t *stats = NULL;
+  size_t free_mem = 0;
+
+  if (unlikely(!info)) {
+    return -EINVAL;
+  }
+
+  /* the application may ask before its first cuInit */
+  init_device_prop();
+  dev = get_device_prop(device);
+  if (unlikely(!dev || !dev->mem_limited)) {
+    return -ENODEV;
+  }
+
+  free_mem = ledger_free_mem(dev);
+  stats = &dev->fb_info->wait_stats;
+
+  info->limit = dev->fb_info->total_mem;
+  info->remaining = MIN(free_mem, info->limit);
+  info->used = info->limit - info->remaining;
+  info->charged = dev->alloc_mem;
+  info->waits = atomic_load_explicit(&stats->waits, memory_order_relaxed);
+  info->wait_timeouts =
+      atomic_load_explicit(&stats->timeouts, memory_order_relaxed);
+  info->wait_nsec =
+      atomic_load_explicit(&stats->wait_nsec, memory_order_relaxed);
+  info->max_wait_nsec =
+      atomic_load_explicit(&stats->max_wait_nsec, memory_order_relaxed);
+
+  return 0;
+}
+
+EXPORT_API int nvrc_core_info(int device, nvrc_core_info_t *info) {
+  device_prop_t *dev = NULL;
+  fb_wait_stats_t *stats = NULL;
+  int tokens = 0;
+
+  if (unlikely(!info)) {
+    return -EINVAL;
+  }
+
+  init_device_prop();
+  dev = get_device_prop(device);
+  if (unlikely(!dev || !dev->core_limited)) {
+    return -ENODEV;
+  }
+
+  stats = &dev->throttle_stats;
+  sem_getvalue(&dev->tokens, &tokens);
+
+  info->limit = dev->attr->params.core_limit;
+  info->add_per_cycle = atomic_load_explicit(&dev->attr->params.add_per_cycle,
+                                             memory_order_relaxed);
+  info->tokens = tokens;
+  info->throttled = atomic_load_explicit(&stats->waits, memory_order_relaxed);
+  info->throttle_nsec =
+      atomic_load_explicit(&stats->wait_nsec, memory_order_relaxed);
+  info->max_throttle_nsec =
+      atomic_load_explicit(&stats->max_wait_nsec, memory_order_relaxed);
+
+  return 0;
+}
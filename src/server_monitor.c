@@ -262,9 +262,14 @@ void watch_dog(nvml_lib_t *hdr, uint32_t minor, const char *cgroup_id,
   int util = 0;
   struct timespec last_time = {0, 0};
   token_attr_t *attr = NULL;
+  fb_info_t *fb_info = NULL;
   uint32_t cur_clock = 0, max_clock = 0;
   char path[PATH_MAX] = {0};
-  share_data_t attr_share_data;
+  share_data_t attr_share_data, fb_share_data;
+  node_summary_t *summary = NULL;
+  node_ref_t *node_ref = NULL;
+  hist_ring_t *hist = NULL;
+  size_t window_ms = 0;
 
   ret = hdr->nvmlDeviceGetHandleByIndex(minor, &dev);
   if (unlikely(ret)) {
@@ -280,6 +285,27 @@ void watch_dog(nvml_lib_t *hdr, uint32_t minor, const char *cgroup_id,
   }
 
   init_attr(attr, limit);
+
+  /* reclaim the memory budget of killed processes */
+  sprintf(path, HOOK_SHM_FB_MEM_PATH_PATTERN, minor);
+  fb_info = create_shm_addr(path, sizeof(fb_info_t), &fb_share_data);
+  if (unlikely(!fb_info)) {
+    LOGGER(WARN, "can't find fb shm addr");
+  }
+
+  /* keep the node summary of the container fresh */
+  if (likely(fb_info) && !get_node_summary(path, sizeof(path))) {
+    summary = node_summary_map(path);
+    if (summary) {
+      node_ref = node_slot_attach(summary, cgroup_id, minor);
+    }
+  }
+
+  /* fill history windows in which no allocation changed the usage */
+  if (likely(fb_info) && !get_mem_history(&window_ms)) {
+    hist = hist_map(minor, window_ms);
+  }
+
   samples = malloc(sizeof(nvmlProcessUtilizationSample_t) * sample_size);
   if (unlikely(!samples)) {
     LOGGER(ERROR, "can't alloc samples");
@@ -306,6 +332,16 @@ void watch_dog(nvml_lib_t *hdr, uint32_t minor, const char *cgroup_id,
   while (1) {
     clock_gettime(CLOCK_REALTIME, &last_time);
     wait_duration(&wait_time);
+    if (likely(fb_info)) {
+      charge_scavenge(fb_info, 0);
+    }
+    if (node_ref) {
+      node_slot_update(node_ref, fb_info);
+    }
+    if (hist) {
+      hist_record(hist, fb_info);
+    }
+
     util = get_gpu_util(hdr, dev, cgroup_id, samples, sample_size, &last_time);
     if (unlikely(util < 0)) {
       continue;
@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hook.h"
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+#define SLAB_BATCH (SLAB_MAGAZINE_SIZE / 2)
+/* id of caches past SLAB_MAX_CACHES, they go to the depot every time */
+#define SLAB_UNMAGAZINED (-2)
+
+typedef struct {
+  int count;
+  void *objs[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+typedef struct {
+  int registered;
+  slab_cache_t *caches[SLAB_MAX_CACHES];
+  slab_magazine_t magazines[SLAB_MAX_CACHES];
+} slab_thread_t;
+
+static __thread slab_thread_t slab_thread;
+
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+static pthread_mutex_t slab_id_mu = PTHREAD_MUTEX_INITIALIZER;
+static int slab_next_id = 0;
+
+static inline void *slab_next(void *obj) { return *(void **)obj; }
+
+static inline void slab_link(void *obj, void *next) { *(void **)obj = next; }
+
+static inline size_t slab_obj_size(const slab_cache_t *cache) {
+  size_t size = MAX(cache->obj_size, sizeof(void *));
+
+  return (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+/* must be called with cache->mu held */
+static void slab_depot_put(slab_cache_t *cache, void **objs, int count) {
+  int i = 0;
+
+  for (i = 0; i < count; i++) {
+    slab_link(objs[i], cache->free_list);
+    cache->free_list = objs[i];
+  }
+  cache->free_count += count;
+}
+
+static void slab_thread_exit(void *arg) {
+  slab_thread_t *thread = arg;
+  slab_magazine_t *mag = NULL;
+  slab_cache_t *cache = NULL;
+  int i = 0;
+
+  for (i = 0; i < SLAB_MAX_CACHES; i++) {
+    cache = thread->caches[i];
+    mag = &thread->magazines[i];
+    if (!cache || !mag->count) {
+      continue;
+    }
+
+    pthread_mutex_lock(&cache->mu);
+    slab_depot_put(cache, mag->objs, mag->count);
+    pthread_mutex_unlock(&cache->mu);
+    mag->count = 0;
+  }
+}
+
+static void slab_key_init(void) {
+  if (unlikely(pthread_key_create(&slab_key, slab_thread_exit))) {
+    LOGGER(FATAL, "can't create slab thread key");
+  }
+}
+
+static int slab_cache_id(slab_cache_t *cache) {
+  int id = atomic_load(&cache->id);
+
+  if (likely(id != -1)) {
+    return id;
+  }
+
+  pthread_mutex_lock(&slab_id_mu);
+  id = atomic_load(&cache->id);
+  if (id == -1) {
+    if (likely(slab_next_id < SLAB_MAX_CACHES)) {
+      id = slab_next_id++;
+    } else {
+      LOGGER(WARN, "slab %s beyond %d caches, unmagazined", cache->name,
+             SLAB_MAX_CACHES);
+      id = SLAB_UNMAGAZINED;
+    }
+    atomic_store(&cache->id, id);
+  }
+  pthread_mutex_unlock(&slab_id_mu);
+
+  return id;
+}
+
+/* the magazine of cache for this thread, NULL if it has none */
+static slab_magazine_t *slab_magazine(slab_cache_t *cache) {
+  int id = slab_cache_id(cache);
+
+  if (unlikely(id == SLAB_UNMAGAZINED)) {
+    return NULL;
+  }
+
+  if (unlikely(!slab_thread.registered)) {
+    pthread_once(&slab_key_once, slab_key_init);
+    pthread_setspecific(slab_key, &slab_thread);
+    slab_thread.registered = 1;
+  }
+
+  if (unlikely(!slab_thread.caches[id])) {
+    slab_thread.caches[id] = cache;
+  }
+
+  return &slab_thread.magazines[id];
+}
+
+/* must be called with cache->mu held */
+static int slab_grow(slab_cache_t *cache) {
+  void *chunk = NULL;
+
+  chunk = mmap(NULL, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (unlikely(chunk == MAP_FAILED)) {
+    return -ENOMEM;
+  }
+
+  slab_link(chunk, cache->chunks);
+  cache->chunks = chunk;
+  cache->cursor = (char *)chunk + SLAB_ALIGN;
+  cache->limit = (char *)chunk + SLAB_CHUNK_SIZE;
+  atomic_fetch_add(&cache->chunk_bytes, SLAB_CHUNK_SIZE);
+
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "slab %s grow to %lu bytes", cache->name,
+         atomic_load(&cache->chunk_bytes));
+#endif
+
+  return 0;
+}
+
+static void slab_refill(slab_cache_t *cache, slab_magazine_t *mag) {
+  size_t size = slab_obj_size(cache);
+
+  pthread_mutex_lock(&cache->mu);
+  while (mag->count < SLAB_BATCH && cache->free_list) {
+    mag->objs[mag->count++] = cache->free_list;
+    cache->free_list = slab_next(cache->free_list);
+    cache->free_count--;
+  }
+
+  while (mag->count < SLAB_BATCH) {
+    if ((!cache->cursor || cache->cursor + size > cache->limit) &&
+        slab_grow(cache)) {
+      break;
+    }
+
+    mag->objs[mag->count++] = cache->cursor;
+    cache->cursor += size;
+  }
+  pthread_mutex_unlock(&cache->mu);
+}
+
+/* a single object straight from the depot, for unmagazined caches */
+static void *slab_depot_get(slab_cache_t *cache) {
+  size_t size = slab_obj_size(cache);
+  void *obj = NULL;
+
+  pthread_mutex_lock(&cache->mu);
+  if (cache->free_list) {
+    obj = cache->free_list;
+    cache->free_list = slab_next(obj);
+    cache->free_count--;
+  } else if ((cache->cursor && cache->cursor + size <= cache->limit) ||
+             !slab_grow(cache)) {
+    obj = cache->cursor;
+    cache->cursor += size;
+  }
+  pthread_mutex_unlock(&cache->mu);
+
+  return obj;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+  slab_magazine_t *mag = slab_magazine(cache);
+  void *obj = NULL;
+
+  if (unlikely(!mag)) {
+    obj = slab_depot_get(cache);
+    if (unlikely(!obj)) {
+      return NULL;
+    }
+    goto done;
+  }
+
+  if (unlikely(!mag->count)) {
+    slab_refill(cache, mag);
+    if (unlikely(!mag->count)) {
+      return NULL;
+    }
+  }
+
+  obj = mag->objs[--mag->count];
+
+done:
+  atomic_fetch_add_explicit(&cache->in_use, 1, memory_order_relaxed);
+  memset(obj, 0x0, cache->obj_size);
+
+  return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj) {
+  slab_magazine_t *mag = NULL;
+
+  if (unlikely(!obj)) {
+    return;
+  }
+
+  mag = slab_magazine(cache);
+  if (unlikely(!mag)) {
+    pthread_mutex_lock(&cache->mu);
+    slab_depot_put(cache, &obj, 1);
+    pthread_mutex_unlock(&cache->mu);
+    goto done;
+  }
+
+  if (unlikely(mag->count == SLAB_MAGAZINE_SIZE)) {
+    pthread_mutex_lock(&cache->mu);
+    slab_depot_put(cache, &mag->objs[SLAB_BATCH], SLAB_BATCH);
+    pthread_mutex_unlock(&cache->mu);
+    mag->count = SLAB_BATCH;
+  }
+
+  mag->objs[mag->count++] = obj;
+
+done:
+  atomic_fetch_sub_explicit(&cache->in_use, 1, memory_order_relaxed);
+}
+
+void slab_stats(slab_cache_t *cache, slab_stats_t *stats) {
+  stats->obj_size = slab_obj_size(cache);
+  stats->in_use = atomic_load(&cache->in_use);
+  stats->reserved_bytes = atomic_load(&cache->chunk_bytes);
+}
@@ -1,23 +1,75 @@
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
-#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "hook.h"
 
-entry_t *find_entry(entry_t *list, int size, const char *symbol) {
+static const char *entry_key(const entry_t *entry, int proc) {
+  return proc && entry->proc_name ? entry->proc_name : entry->name;
+}
+
+static uint32_t entry_hash(const char *symbol, uint32_t seed) {
+  /* FNV-1a */
+  uint32_t hash = 0x811c9dc5U ^ seed;
+
+  while (*symbol) {
+    hash = (hash ^ (uint8_t)*symbol++) * 0x01000193U;
+  }
+
+  return hash ^ (hash >> 15);
+}
+
+/*
+ * find a seed hashing every entry of list to its own slot, keyed by
+ * proc_name for cuGetProcAddress lookups if proc is set
+ */
+int entry_index_build(entry_index_t *index, const entry_t *list, int size,
+                      int proc) {
+  uint32_t slot = 0;
   int i = 0;
 
-  for (i = 0; i < size; i++) {
-    if (!strcmp(list[i].name, symbol)) {
-      return &list[i];
+  if (unlikely(size >= ENTRY_INDEX_SIZE)) {
+    return -E2BIG;
+  }
+
+  for (index->seed = 1; index->seed < (1U << 16); index->seed++) {
+    memset(index->slots, 0, sizeof(index->slots));
+    for (i = 0; i < size; i++) {
+      slot = entry_hash(entry_key(&list[i], proc), index->seed) &
+             (ENTRY_INDEX_SIZE - 1);
+      if (index->slots[slot]) {
+        break;
+      }
+      index->slots[slot] = i + 1;
+    }
+
+    if (i == size) {
+      return 0;
     }
   }
 
-  return NULL;
+  return -ENOSPC;
+}
+
+entry_t *entry_index_find(const entry_index_t *index, entry_t *list, int proc,
+                          const char *symbol) {
+  uint32_t slot = 0;
+  entry_t *entry = NULL;
+
+  slot = index->slots[entry_hash(symbol, index->seed) &
+                      (ENTRY_INDEX_SIZE - 1)];
+  if (likely(!slot)) {
+    return NULL;
+  }
+
+  entry = &list[slot - 1];
+  return !strcmp(entry_key(entry, proc), symbol) ? entry : NULL;
 }
 
 size_t iec_to_bytes(const char *iec_value) {
@@ -58,27 +110,6 @@ char *get_env_from(const char *str) {
   return pos + 1;
 }
 
-int get_device_number(int fd, uint32_t *major, uint32_t *minor) {
-  int ret = 0;
-  struct stat st;
-
-  ret = fstat(fd, &st);
-  if (unlikely(ret < 0)) {
-    return ret;
-  }
-
-  *major = 0;
-  *minor = 0;
-  if (unlikely((st.st_mode & S_IFMT) != S_IFCHR)) {
-    return -1;
-  }
-
-  *major = major(st.st_rdev);
-  *minor = minor(st.st_rdev);
-
-  return 0;
-}
-
 int get_cgroup_id(pid_t pid, char *short_id, size_t id_len) {
   char path[PATH_MAX] = {0};
   FILE *fp = NULL;
@@ -125,6 +156,133 @@ done:
   return ret;
 }
 
+/* start time of pid in clock ticks since boot, 0 if it can't be read */
+uint64_t get_proc_start_time(pid_t pid) {
+  char path[PATH_MAX] = {0};
+  char buf[1024] = {0};
+  char *p = NULL, *saveptr = NULL;
+  uint64_t start_time = 0;
+  FILE *fp = NULL;
+  size_t n = 0;
+  int field = 0;
+
+  sprintf(path, "/proc/%d/stat", pid);
+  fp = fopen(path, "r");
+  if (unlikely(!fp)) {
+    goto done;
+  }
+
+  n = fread(buf, 1, sizeof(buf) - 1, fp);
+  buf[n] = '\0';
+
+  /* comm may contain spaces, fields are counted from the last ')' */
+  p = strrchr(buf, ')');
+  if (unlikely(!p)) {
+    goto done;
+  }
+
+  /* starttime is field 22, the state after ')' is field 3 */
+  for (p = strtok_r(p + 1, " ", &saveptr), field = 3; p;
+       p = strtok_r(NULL, " ", &saveptr), field++) {
+    if (field == 22) {
+      start_time = strtoull(p, NULL, 10);
+      break;
+    }
+  }
+
+done:
+  if (likely(fp)) {
+    fclose(fp);
+    fp = NULL;
+  }
+
+  return start_time;
+}
+
+/* the word lives in shm, so no FUTEX_PRIVATE_FLAG */
+/* minor of the nvidia device at PCI bus id, e.g. 0000:3B:00.0 */
+int get_device_minor(const char *bus_id, int *minor) {
+  char path[PATH_MAX] = {0};
+  char name[32] = {0};
+  FILE *fp = NULL;
+  char *line = NULL;
+  size_t len = 0, i = 0;
+  int ret = -1;
+
+  /* the driver names its proc entries in lower case */
+  for (i = 0; bus_id[i] && i < sizeof(name) - 1; i++) {
+    name[i] = tolower((unsigned char)bus_id[i]);
+  }
+
+  sprintf(path, "/proc/driver/nvidia/gpus/%s/information", name);
+  fp = fopen(path, "r");
+  if (unlikely(!fp)) {
+    goto done;
+  }
+
+  while (getline(&line, &len, fp) != -1) {
+    if (sscanf(line, "Device Minor: %d", minor) == 1) {
+      ret = 0;
+      break;
+    }
+  }
+
+done:
+  free(line);
+  if (likely(fp)) {
+    fclose(fp);
+    fp = NULL;
+  }
+
+  return ret;
+}
+
+int futex_wait(atomic_uint *addr, uint32_t val,
+               const struct timespec *timeout) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+void futex_wake(atomic_uint *addr, int count) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/* wake processes waiting for free_mem to grow */
+void fb_info_notify(fb_info_t *fb_info) {
+  atomic_fetch_add_explicit(&fb_info->free_seq, 1, memory_order_release);
+  if (unlikely(atomic_load(&fb_info->waiters) > 0)) {
+    futex_wake(&fb_info->free_seq, INT_MAX);
+  }
+}
+
+/* bytes actually allocated from the ledger, idle leases excluded */
+size_t fb_info_committed(fb_info_t *fb_info) {
+  size_t total_mem = fb_info->total_mem;
+  size_t free_mem =
+      atomic_load_explicit(&fb_info->free_mem, memory_order_relaxed) +
+      atomic_load_explicit(&fb_info->leased, memory_order_relaxed);
+
+  return total_mem > free_mem ? total_mem - free_mem : 0;
+}
+
+/* record one wait of waited nanoseconds */
+void wait_stats_account(fb_wait_stats_t *stats, uint64_t waited,
+                        int timeout) {
+  uint64_t max = atomic_load_explicit(&stats->max_wait_nsec,
+                                      memory_order_relaxed);
+
+  atomic_fetch_add_explicit(&stats->waits, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->wait_nsec, waited, memory_order_relaxed);
+  if (timeout) {
+    atomic_fetch_add_explicit(&stats->timeouts, 1, memory_order_relaxed);
+  }
+
+  while (waited > max && !atomic_compare_exchange_weak_explicit(
+                             &stats->max_wait_nsec, &max, waited,
+                             memory_order_relaxed, memory_order_relaxed)) {
+    continue;
+  }
+}
+
 void *create_shm_addr(const char *shm_path, size_t data_size,
                       share_data_t *share_data) {
   int ret = 0;
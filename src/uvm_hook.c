@@ -0,0 +1,401 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dispatch.h"
+#include "extern.h"
+#include "hook.h"
+#include "nvstatus.h"
+#include "slab.h"
+#include "uvm.h"
+
+/*
+ * Managed memory accounting.
+ *
+ * cudaMallocManaged reserves its range by mmap'ing /dev/nvidia-uvm, the
+ * UVM driver populates it from its own allocator without any RM ioctl we
+ * could see. A managed range may become fully resident on the device, so
+ * its whole length is charged when it is mapped and credited on UVM_FREE,
+ * munmap, UVM_DEINITIALIZE or the close of the UVM fd, whichever comes
+ * first. A munmap of part of a range credits that part and keeps tracking
+ * the rest.
+ *
+ * UVM doesn't tell which GPU a range will live on, ranges are charged to
+ * the limited device when there is exactly one.
+ */
+
+typedef struct {
+  uint64_t base;
+  size_t length;
+  device_prop_t *dev;
+  prof_site_t *site;
+} uvm_range_t;
+
+extern device_prop_t *get_mem_default_device(void);
+
+#define UVM_MIN_CAPACITY 16
+
+static pthread_mutex_t uvm_mu = PTHREAD_MUTEX_INITIALIZER;
+/* tracked ranges sorted by base, mappings never overlap. Guarded by uvm_mu */
+static uvm_range_t **uvm_ranges;
+static size_t uvm_capacity;
+/* length of uvm_ranges, lets munmap skip the lock when nothing is tracked */
+static atomic_int uvm_range_count;
+/* hull of the tracked ranges, lets munmap skip unrelated spans */
+static atomic_uint_fast64_t uvm_lo = UINT64_MAX;
+static atomic_uint_fast64_t uvm_hi;
+static slab_cache_t uvm_range_cache = SLAB_CACHE_INIT("uvm_range", uvm_range_t);
+
+static void uvm_account(device_prop_t *dev, size_t length, int charge) {
+  pthread_mutex_lock(&dev->mu);
+  if (charge) {
+    dev->alloc_mem += length;
+  } else {
+    dev->alloc_mem -= length;
+  }
+  watermark_check(dev);
+  pthread_mutex_unlock(&dev->mu);
+}
+
+/* index of the first range ending above addr, must hold uvm_mu */
+static size_t uvm_search(uint64_t addr) {
+  size_t lo = 0, hi = atomic_load_explicit(&uvm_range_count,
+                                           memory_order_relaxed);
+  size_t mid = 0;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (uvm_ranges[mid]->base + uvm_ranges[mid]->length <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* must hold uvm_mu */
+static void uvm_update_hull(void) {
+  int count = atomic_load_explicit(&uvm_range_count, memory_order_relaxed);
+  uvm_range_t *last = NULL;
+
+  if (!count) {
+    atomic_store(&uvm_lo, UINT64_MAX);
+    atomic_store(&uvm_hi, 0);
+    return;
+  }
+
+  last = uvm_ranges[count - 1];
+  atomic_store(&uvm_lo, uvm_ranges[0]->base);
+  atomic_store(&uvm_hi, last->base + last->length);
+}
+
+/* must hold uvm_mu */
+static int uvm_insert_at(size_t index, uvm_range_t *range) {
+  size_t count = atomic_load_explicit(&uvm_range_count, memory_order_relaxed);
+  size_t capacity = 0;
+  uvm_range_t **ranges = NULL;
+
+  if (unlikely(count == uvm_capacity)) {
+    capacity = MAX(uvm_capacity * 2, UVM_MIN_CAPACITY);
+    ranges = realloc(uvm_ranges, capacity * sizeof(*ranges));
+    if (unlikely(!ranges)) {
+      return -ENOMEM;
+    }
+    uvm_ranges = ranges;
+    uvm_capacity = capacity;
+  }
+
+  memmove(&uvm_ranges[index + 1], &uvm_ranges[index],
+          (count - index) * sizeof(*uvm_ranges));
+  uvm_ranges[index] = range;
+  atomic_store(&uvm_range_count, count + 1);
+  uvm_update_hull();
+
+  return 0;
+}
+
+/* must hold uvm_mu */
+static void uvm_remove_at(size_t index) {
+  size_t count = atomic_load_explicit(&uvm_range_count, memory_order_relaxed);
+
+  memmove(&uvm_ranges[index], &uvm_ranges[index + 1],
+          (count - index - 1) * sizeof(*uvm_ranges));
+  atomic_store(&uvm_range_count, count - 1);
+  uvm_update_hull();
+}
+
+/* reserve a managed range before it is mapped */
+int uvm_pre_mmap(size_t length, device_prop_t **dev) {
+  static atomic_int warned = 0;
+
+  *dev = get_mem_default_device();
+  if (unlikely(!*dev)) {
+    if (!atomic_exchange(&warned, 1)) {
+      LOGGER(WARN, "managed memory isn't charged with several limited devices");
+    }
+    return 0;
+  }
+
+  if (ledger_reserve(*dev, length)) {
+    *dev = NULL;
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+/* commit the reservation of uvm_pre_mmap, or give it back on failure */
+void uvm_post_mmap(device_prop_t *dev, void *addr, size_t length) {
+  uvm_range_t *range = NULL;
+  size_t index = 0;
+  int ret = 0;
+
+  if (!dev) {
+    return;
+  }
+
+  if (unlikely(addr == MAP_FAILED)) {
+    ledger_release(dev, length);
+    return;
+  }
+
+  range = slab_alloc(&uvm_range_cache);
+  if (unlikely(!range)) {
+    ret = -ENOMEM;
+    goto finish;
+  }
+
+  range->base = (uint64_t)addr;
+  range->length = length;
+  range->dev = dev;
+  range->site = prof_alloc(length);
+
+  pthread_mutex_lock(&uvm_mu);
+  index = uvm_search(range->base);
+  if (unlikely(index < (size_t)atomic_load(&uvm_range_count) &&
+               uvm_ranges[index]->base < range->base + length)) {
+    /* the range of an unmap we didn't see */
+    ret = -EEXIST;
+  } else {
+    ret = uvm_insert_at(index, range);
+  }
+  pthread_mutex_unlock(&uvm_mu);
+
+finish:
+  if (unlikely(ret)) {
+    LOGGER(WARN, "track managed range %p failed %d", addr, ret);
+    if (range) {
+      prof_free(range->site, length);
+      slab_free(&uvm_range_cache, range);
+    }
+    ledger_release(dev, length);
+    return;
+  }
+
+  uvm_account(dev, length, 1);
+
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "managed range %p, device: %u, size: %lu", addr, dev->minor,
+         length);
+#endif
+}
+
+static void uvm_free_range(uvm_range_t *range) {
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "free managed range %p, size: %lu", (void *)range->base,
+         range->length);
+#endif
+
+  ledger_release(range->dev, range->length);
+  uvm_account(range->dev, range->length, 0);
+  prof_free(range->site, range->length);
+  slab_free(&uvm_range_cache, range);
+}
+
+void uvm_untrack(uint64_t base) {
+  uvm_range_t *range = NULL;
+  size_t index = 0;
+
+  if (likely(!atomic_load_explicit(&uvm_range_count, memory_order_relaxed))) {
+    return;
+  }
+
+  pthread_mutex_lock(&uvm_mu);
+  index = uvm_search(base);
+  if (index < (size_t)atomic_load(&uvm_range_count) &&
+      uvm_ranges[index]->base == base) {
+    range = uvm_ranges[index];
+    uvm_remove_at(index);
+  }
+  pthread_mutex_unlock(&uvm_mu);
+
+  if (range) {
+    uvm_free_range(range);
+  }
+}
+
+/*
+ * cut [start, end) out of the overlapping range at index, must hold uvm_mu.
+ * Returns the bytes no longer tracked, the range is left without any part
+ * of the span, or removed with *detached set if nothing of it remains.
+ */
+static size_t uvm_cut_range(size_t index, uint64_t start, uint64_t end,
+                            int *detached) {
+  uvm_range_t *range = uvm_ranges[index];
+  uint64_t base = range->base, limit = range->base + range->length;
+  uvm_range_t *tail = NULL;
+  size_t cut = 0;
+
+  *detached = 0;
+  if (start <= base && end >= limit) {
+    uvm_remove_at(index);
+    *detached = 1;
+    return range->length;
+  }
+
+  if (start <= base) {
+    /* the head is gone, the new base keeps the order */
+    range->base = end;
+    range->length = limit - end;
+    uvm_update_hull();
+    cut = end - base;
+    goto finish;
+  }
+
+  if (end < limit) {
+    /* a hole in the middle, the part above it becomes a range of its own */
+    tail = slab_alloc(&uvm_range_cache);
+    if (likely(tail)) {
+      *tail = (uvm_range_t){.base = end,
+                            .length = limit - end,
+                            .dev = range->dev,
+                            .site = range->site};
+      if (likely(!uvm_insert_at(index + 1, tail))) {
+        prof_adjust(range->site, 1, 0);
+      } else {
+        slab_free(&uvm_range_cache, tail);
+        tail = NULL;
+      }
+    }
+
+    /* without a tail record its bytes are credited with the hole */
+    if (unlikely(!tail)) {
+      LOGGER(WARN, "split managed range %p failed", (void *)base);
+      end = limit;
+    }
+  } else {
+    end = limit;
+  }
+
+  cut = end - start;
+  range->length = start - base;
+  uvm_update_hull();
+
+finish:
+  prof_adjust(range->site, 0, -(long)cut);
+  return cut;
+}
+
+/* credit the managed memory in an unmapped span */
+void uvm_unmap(uint64_t addr, size_t length) {
+  uvm_range_t *hits[16];
+  device_prop_t *devs[16];
+  size_t cuts[16];
+  int detached[16];
+  uint64_t end = addr + length;
+  size_t index = 0;
+  int count = 0, i = 0;
+
+  if (likely(!atomic_load_explicit(&uvm_range_count, memory_order_relaxed))) {
+    return;
+  }
+
+  if (end <= atomic_load_explicit(&uvm_lo, memory_order_relaxed) ||
+      addr >= atomic_load_explicit(&uvm_hi, memory_order_relaxed)) {
+    return;
+  }
+
+  do {
+    count = 0;
+    pthread_mutex_lock(&uvm_mu);
+
+    /* overlapping ranges are adjacent in the array */
+    index = uvm_search(addr);
+    while (count < (int)(sizeof(hits) / sizeof(hits[0])) &&
+           index < (size_t)atomic_load(&uvm_range_count) &&
+           uvm_ranges[index]->base < end) {
+      hits[count] = uvm_ranges[index];
+      devs[count] = hits[count]->dev;
+      cuts[count] = uvm_cut_range(index, addr, end, &detached[count]);
+#ifndef NDEBUG
+      LOGGER(VERBOSE, "unmap %lu bytes of managed range %p", cuts[count],
+             (void *)hits[count]->base);
+#endif
+      /* a detached range makes room for the next one at index */
+      if (!detached[count]) {
+        index++;
+      }
+      count++;
+    }
+
+    pthread_mutex_unlock(&uvm_mu);
+
+    for (i = 0; i < count; i++) {
+      if (detached[i]) {
+        uvm_free_range(hits[i]);
+        continue;
+      }
+
+      ledger_release(devs[i], cuts[i]);
+      uvm_account(devs[i], cuts[i], 0);
+    }
+    /* a full batch may have left more overlapping ranges */
+  } while (count == sizeof(hits) / sizeof(hits[0]));
+}
+
+/* the VA space is gone with every range in it */
+void uvm_untrack_all(void) {
+  uvm_range_t **ranges = NULL;
+  int count = 0, i = 0;
+
+  pthread_mutex_lock(&uvm_mu);
+  ranges = uvm_ranges;
+  count = atomic_load(&uvm_range_count);
+  uvm_ranges = NULL;
+  uvm_capacity = 0;
+  atomic_store(&uvm_range_count, 0);
+  uvm_update_hull();
+  pthread_mutex_unlock(&uvm_mu);
+
+  for (i = 0; i < count; i++) {
+    uvm_free_range(ranges[i]);
+  }
+  free(ranges);
+}
+
+static int uvm_post_ioctl(ioctl_ctx_t *ctx, size_t arg_size, void *args) {
+  UVM_FREE_PARAMS *params = NULL;
+
+  switch (ctx->cmd) {
+    case UVM_FREE:
+      params = args;
+      if (likely(params->rmStatus == NV_OK)) {
+        uvm_untrack(params->base);
+      }
+      break;
+    case UVM_DEINITIALIZE:
+      uvm_untrack_all();
+      break;
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+void uvm_register_handlers(void) {
+  register_uvm_handler(UVM_FREE, NULL, uvm_post_ioctl);
+  register_uvm_handler(UVM_DEINITIALIZE, NULL, uvm_post_ioctl);
+}
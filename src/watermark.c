@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "hook.h"
+#include "nvrc.h"
+
+/*
+ * Memory watermarks, see nvrc.h.
+ *
+ * The accounting paths call watermark_check() after every commit and free.
+ * It only compares usage against the nearest armed threshold of the device
+ * and kicks the helper thread on a crossing, so callbacks never run on the
+ * ioctl path. The helper also polls, which picks up usage changed by other
+ * processes sharing the ledger.
+ */
+
+#define MAX_WATERMARKS 16
+
+typedef struct {
+  int used;
+  int device;
+  size_t high;
+  size_t low;
+  int fd;
+  nvrc_watermark_cb_t cb;
+  void *arg;
+  /* between a HIGH and the following LOW event */
+  int above;
+  /* tells a registration from a later one reusing the slot */
+  uint32_t gen;
+} watermark_t;
+
+typedef struct {
+  int id;
+  uint32_t gen;
+  int fd;
+  nvrc_watermark_cb_t cb;
+  void *arg;
+  int device;
+  nvrc_watermark_event_t event;
+  size_t used;
+  size_t limit;
+} watermark_event_t;
+
+extern device_prop_t *get_device_prop(int device_id);
+
+static pthread_mutex_t watermark_mu = PTHREAD_MUTEX_INITIALIZER;
+static watermark_t watermarks[MAX_WATERMARKS];
+static pthread_once_t watermark_once = PTHREAD_ONCE_INIT;
+static pthread_t watermark_tid;
+/* futex word kicking the helper thread */
+static atomic_uint watermark_seq;
+static uint32_t watermark_gen;
+/* id of the callback running on the helper thread, -1 if none */
+static int watermark_running = -1;
+static pthread_cond_t watermark_done = PTHREAD_COND_INITIALIZER;
+static __thread int watermark_on_post = 0;
+
+/*
+ * per device, usage at or above arm_high crosses some watermark upwards,
+ * usage below arm_low crosses some watermark downwards, 0 disarms
+ */
+static atomic_size_t arm_high[MAX_DEVICE_COUNT];
+static atomic_size_t arm_low[MAX_DEVICE_COUNT];
+
+static size_t device_used(device_prop_t *dev) {
+  size_t free_mem = ledger_free_mem(dev);
+  size_t total_mem = dev->fb_info->total_mem;
+
+  return total_mem > free_mem ? total_mem - free_mem : 0;
+}
+
+void watermark_check(device_prop_t *dev) {
+  size_t high = 0, low = 0, used = 0;
+
+  if (unlikely(dev->minor >= MAX_DEVICE_COUNT)) {
+    return;
+  }
+
+  high = atomic_load_explicit(&arm_high[dev->minor], memory_order_relaxed);
+  low = atomic_load_explicit(&arm_low[dev->minor], memory_order_relaxed);
+  if (likely(!high && !low)) {
+    return;
+  }
+
+  used = device_used(dev);
+  if ((high && used >= high) || used < low) {
+    atomic_fetch_add_explicit(&watermark_seq, 1, memory_order_release);
+    futex_wake(&watermark_seq, 1);
+  }
+}
+
+/* must be called with watermark_mu held */
+static void watermark_rearm(void) {
+  size_t high[MAX_DEVICE_COUNT] = {0};
+  size_t low[MAX_DEVICE_COUNT] = {0};
+  watermark_t *wm = NULL;
+  int i = 0;
+
+  for (i = 0; i < MAX_WATERMARKS; i++) {
+    wm = &watermarks[i];
+    if (!wm->used) {
+      continue;
+    }
+
+    if (!wm->above && (!high[wm->device] || wm->high < high[wm->device])) {
+      high[wm->device] = wm->high;
+    }
+    if (wm->above && wm->low + 1 > low[wm->device]) {
+      low[wm->device] = wm->low + 1;
+    }
+  }
+
+  for (i = 0; i < MAX_DEVICE_COUNT; i++) {
+    atomic_store_explicit(&arm_high[i], high[i], memory_order_relaxed);
+    atomic_store_explicit(&arm_low[i], low[i], memory_order_relaxed);
+  }
+}
+
+static void watermark_fire(watermark_event_t *event) {
+  uint64_t one = 1;
+
+#ifndef NDEBUG
+  LOGGER(VERBOSE, "watermark %s on device %d, used: %lu, limit: %lu",
+         event->event == NVRC_WATERMARK_HIGH ? "high" : "low", event->device,
+         event->used, event->limit);
+#endif
+
+  if (event->fd >= 0) {
+    if (unlikely(write(event->fd, &one, sizeof(one)) != sizeof(one))) {
+      LOGGER(WARN, "signal watermark eventfd %d failed %d", event->fd, errno);
+    }
+    return;
+  }
+
+  event->cb(event->device, event->event, event->used, event->limit,
+            event->arg);
+}
+
+/*
+ * signal crossings, must be called with watermark_mu held. Eventfds are
+ * written right away so an unregistered fd is never touched, callbacks are
+ * returned to run unlocked.
+ */
+static int watermark_scan(watermark_event_t *events) {
+  watermark_t *wm = NULL;
+  device_prop_t *dev = NULL;
+  size_t used = 0;
+  int count = 0;
+  int i = 0;
+
+  for (i = 0; i < MAX_WATERMARKS; i++) {
+    wm = &watermarks[i];
+    if (!wm->used) {
+      continue;
+    }
+
+    dev = get_device_prop(wm->device);
+    used = device_used(dev);
+    if (!wm->above && used >= wm->high) {
+      wm->above = 1;
+      events[count].event = NVRC_WATERMARK_HIGH;
+    } else if (wm->above && used <= wm->low) {
+      wm->above = 0;
+      events[count].event = NVRC_WATERMARK_LOW;
+    } else {
+      continue;
+    }
+
+    events[count].id = i;
+    events[count].gen = wm->gen;
+    events[count].fd = wm->fd;
+    events[count].cb = wm->cb;
+    events[count].arg = wm->arg;
+    events[count].device = wm->device;
+    events[count].used = used;
+    events[count].limit = dev->fb_info->total_mem;
+    if (wm->fd >= 0) {
+      watermark_fire(&events[count]);
+      continue;
+    }
+    count++;
+  }
+
+  watermark_rearm();
+
+  return count;
+}
+
+/*
+ * run a callback unless its watermark was unregistered since the scan,
+ * unregister waits for the one in flight
+ */
+static void watermark_call(watermark_event_t *event) {
+  watermark_t *wm = &watermarks[event->id];
+
+  pthread_mutex_lock(&watermark_mu);
+  if (unlikely(!wm->used || wm->gen != event->gen)) {
+    pthread_mutex_unlock(&watermark_mu);
+    return;
+  }
+  watermark_running = event->id;
+  pthread_mutex_unlock(&watermark_mu);
+
+  watermark_fire(event);
+
+  pthread_mutex_lock(&watermark_mu);
+  watermark_running = -1;
+  pthread_cond_broadcast(&watermark_done);
+  pthread_mutex_unlock(&watermark_mu);
+}
+
+static void *watermark_post(void *arg) {
+  watermark_event_t events[MAX_WATERMARKS];
+  struct timespec timeout = {
+      .tv_sec = 0,
+      .tv_nsec = NVRC_WATERMARK_POLL_MS * 1000UL * 1000UL,
+  };
+  uint32_t seq = 0;
+  int count = 0;
+  int i = 0;
+
+  LOGGER(VERBOSE, "start watermark post");
+  watermark_on_post = 1;
+  while (1) {
+    seq = atomic_load_explicit(&watermark_seq, memory_order_acquire);
+
+    pthread_mutex_lock(&watermark_mu);
+    count = watermark_scan(events);
+    pthread_mutex_unlock(&watermark_mu);
+
+    /* callbacks may register or unregister, run them unlocked */
+    for (i = 0; i < count; i++) {
+      watermark_call(&events[i]);
+    }
+
+    futex_wait(&watermark_seq, seq, &timeout);
+  }
+
+  return NULL;
+}
+
+static void watermark_start(void) {
+  pthread_create(&watermark_tid, NULL, watermark_post, NULL);
+}
+
+static int watermark_add(int device, size_t high, size_t low, int fd,
+                         nvrc_watermark_cb_t cb, void *arg) {
+  device_prop_t *dev = NULL;
+  int id = -ENOSPC;
+  int i = 0;
+
+  init_device_prop();
+  dev = get_device_prop(device);
+  if (unlikely(!dev || !dev->mem_limited)) {
+    return -ENODEV;
+  }
+
+  if (unlikely(low >= high)) {
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&watermark_mu);
+  for (i = 0; i < MAX_WATERMARKS; i++) {
+    if (watermarks[i].used) {
+      continue;
+    }
+
+    watermarks[i] = (watermark_t){
+        .used = 1,
+        .device = device,
+        .high = high,
+        .low = low,
+        .fd = fd,
+        .cb = cb,
+        .arg = arg,
+        .above = 0,
+        .gen = ++watermark_gen,
+    };
+    watermark_rearm();
+    id = i;
+    break;
+  }
+  pthread_mutex_unlock(&watermark_mu);
+
+  if (likely(id >= 0)) {
+    pthread_once(&watermark_once, watermark_start);
+    /* usage may already be above the new watermark */
+    atomic_fetch_add_explicit(&watermark_seq, 1, memory_order_release);
+    futex_wake(&watermark_seq, 1);
+  }
+
+  return id;
+}
+
+EXPORT_API int nvrc_api_version(void) { return NVRC_API_VERSION; }
+
+EXPORT_API int nvrc_watermark_register(int device, size_t high, size_t low,
+                                       nvrc_watermark_cb_t cb, void *arg) {
+  if (unlikely(!cb)) {
+    return -EINVAL;
+  }
+
+  return watermark_add(device, high, low, -1, cb, arg);
+}
+
+EXPORT_API int nvrc_watermark_eventfd(int device, size_t high, size_t low,
+                                      int *fd) {
+  int efd = -1;
+  int id = 0;
+
+  if (unlikely(!fd)) {
+    return -EINVAL;
+  }
+
+  efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (unlikely(efd < 0)) {
+    return -errno;
+  }
+
+  id = watermark_add(device, high, low, efd, NULL, NULL);
+  if (unlikely(id < 0)) {
+    close(efd);
+    return id;
+  }
+
+  *fd = efd;
+  return id;
+}
+
+EXPORT_API int nvrc_watermark_unregister(int id) {
+  int fd = -1;
+
+  if (unlikely(id < 0 || id >= MAX_WATERMARKS)) {
+    return -ENOENT;
+  }
+
+  pthread_mutex_lock(&watermark_mu);
+  if (unlikely(!watermarks[id].used)) {
+    pthread_mutex_unlock(&watermark_mu);
+    return -ENOENT;
+  }
+
+  fd = watermarks[id].fd;
+  watermarks[id].used = 0;
+  watermark_rearm();
+
+  /* a callback unregistering itself can't wait for its own return */
+  while (watermark_running == id && !watermark_on_post) {
+    pthread_cond_wait(&watermark_done, &watermark_mu);
+  }
+  pthread_mutex_unlock(&watermark_mu);
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  return 0;
+}